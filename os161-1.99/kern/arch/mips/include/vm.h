@@ -103,6 +103,11 @@
 
 void ram_bootstrap(void);
 paddr_t coremap_stealmem(unsigned long npages);
+unsigned int coremap_freeframes(void);
+void coremap_printstats(void);
+unsigned vm_faultaround_get(void);
+void vm_faultaround_set(unsigned npages);
+void vm_merge_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
@@ -118,9 +123,57 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	uint32_t ts_asid;	/* ts_addrspace's ASID on the target cpu */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Address space IDs (see dumbvm.c). Each cpu hands out the 64
+ * hardware ASIDs in turn. The bits above them count generations: an
+ * address space's ASID on a cpu is only good while its generation
+ * is the cpu's current one, and a cpu that runs out of ASIDs flushes
+ * its TLB and starts a new generation.
+ */
+#define ASID_BITS    6
+#define ASID_MASK    ((1U << ASID_BITS) - 1)
+#define ASID_FIRST   (1U << ASID_BITS)	/* generation 1, ASID 0 */
+
+/*
+ * Per-cpu free page magazines (see dumbvm.c). A cpu caches up to
+ * PAGEMAG_SIZE free frames and refills/drains PAGEMAG_BATCH at a time
+ * against the global coremap.
+ */
+#define PAGEMAG_SIZE  16
+#define PAGEMAG_BATCH 8
+
+/*
+ * Pages of MAP_SHARED mappings are never paged out (see dumbvm.c), so
+ * mmap refuses a shared mapping that would let them take more than
+ * SHARED_LIMIT_PERCENT of the frames.
+ */
+#define SHARED_LIMIT_PERCENT 50
+
+/*
+ * Pool of pre-zeroed frames (see dumbvm.c). Idle cpus start refilling
+ * it when it falls to ZEROPOOL_LOW frames and stop at ZEROPOOL_HIGH.
+ */
+#define ZEROPOOL_LOW  16
+#define ZEROPOOL_HIGH 64
+
+/*
+ * Fault-around (see dumbvm.c): how many pages past a sequential fault
+ * vm_fault maps as well, by default and at most.
+ */
+#define FAULTAROUND_DEFAULT 8
+#define FAULTAROUND_MAX     16
+
+/*
+ * Same-page merging (see dumbvm.c): every MERGE_INTERVAL seconds a
+ * kernel thread looks at the next MERGE_BATCH frames.
+ */
+#define MERGE_INTERVAL 1
+#define MERGE_BATCH    256
+
 
 #endif /* _MIPS_VM_H_ */
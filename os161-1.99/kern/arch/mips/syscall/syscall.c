@@ -35,7 +35,12 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <objcache.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <copyinout.h>
+#endif
 
 /*
  * System call dispatcher.
@@ -81,6 +86,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A3
+	int fd;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -140,6 +149,42 @@ syscall(struct trapframe *tf)
 	  err = sys_execv((char *)tf->tf_a0, (char **)tf->tf_a1);
 	  break;
 #endif
+#if OPT_A3
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_fsync:
+	  err = sys_fsync((int)tf->tf_a0);
+	  break;
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  /* fd is the fifth argument; the 64-bit offset is aligned after it */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	  if (err == 0) {
+		  err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+			       sizeof(offset));
+	  }
+	  if (err == 0) {
+		  err = sys_mmap((userptr_t)tf->tf_a0,
+				 (size_t)tf->tf_a1,
+				 (int)tf->tf_a2,
+				 (int)tf->tf_a3,
+				 fd, offset,
+				 (vaddr_t *)&retval);
+	  }
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+#endif
  
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
@@ -184,11 +229,35 @@ syscall(struct trapframe *tf)
  *
  * Thus, you can trash it and do things another way if you prefer.
  */
+
+/*
+ * Trapframes handed from fork to the child thread are all the same
+ * size and live only until the child starts, so keep them cached.
+ */
+static struct objcache trapframe_cache =
+	OBJCACHE_INITIALIZER("trapframe", struct trapframe, NULL, NULL);
+
+/*
+ * Copy TF for enter_forked_process, which releases the copy.
+ * Returns NULL if out of memory.
+ */
+struct trapframe *
+trapframe_dup(struct trapframe *tf)
+{
+	struct trapframe *copy;
+
+	copy = objcache_get(&trapframe_cache);
+	if (copy != NULL) {
+		*copy = *tf;
+	}
+	return copy;
+}
+
 void
 enter_forked_process(void *tf, unsigned long data)
 {
 	struct trapframe _tf = *((struct trapframe *)tf);
-	kfree((struct trapframe *)tf);
+	objcache_put(&trapframe_cache, tf);
 	_tf.tf_v0 = 0;
 	_tf.tf_a3 = 0;
 	_tf.tf_epc += 4;
@@ -29,14 +29,26 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
 #include <proc.h>
+#include <cpu.h>
+#include <clock.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <array.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <swap.h>
+#include <uw-vmstats.h>
 #include "opt-A3.h"
 
 /*
@@ -47,156 +59,2737 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+#if OPT_A3
+/*
+ * The user stack starts out one page long and grows down on demand
+ * when a fault lands below it, up to DUMBVM_STACKMAXPAGES (4M).
+ */
+#define DUMBVM_STACKINITPAGES  1
+#define DUMBVM_STACKMAXPAGES   1024
+#endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 #if OPT_A3
-static paddr_t coremap_start = 0;
-static paddr_t coremap_end = 0;
-static unsigned int coremap_size = 0;
+/*
+ * Physical page allocator.
+ *
+ * The coremap is an array of struct coremap_entry, one per physical
+ * frame, stored at the bottom of the RAM handed to us by ram_getsize.
+ * The frames after it are managed by a binary buddy allocator: a free
+ * block of order k is 2^k frames long, starts at a frame index that
+ * is a multiple of 2^k, and is linked on freelists[k] through the
+ * coremap entry of its first frame. Allocation and free are both
+ * O(log n) in the number of frames, and freed blocks coalesce with
+ * their buddies.
+ *
+ * Runs that are not a power of two long are carved out of the next
+ * larger block and the unused tail goes straight back on the free
+ * lists, so an npages allocation holds exactly npages frames.
+ *
+ * A frame holding a user page also records which page it is
+ * (cme_as, cme_vaddr), so the page replacement clock can find and
+ * update the page table entry when it evicts the frame.
+ *
+ * A frame holding a whole page of a file that is mapped read-only,
+ * such as program text, may also be in the text cache (cme_vnode,
+ * cme_filepage), so that other processes mapping the same page of the
+ * same file share it; see textcache_lookup.
+ *
+ * The clock's reference bits are kept apart from the coremap entries,
+ * one byte per frame in frame_refbits[], so the TLB refill fast path
+ * in exception-mips1.S can set them with a single store. It finds
+ * them through vm_refbase, which is indexed by physical page number.
+ */
+
+#define COREMAP_NORDERS   18		/* up to 2^17 frames = 512M */
+#define COREMAP_NOFRAME   (-1)
+
+struct coremap_entry {
+	int32_t cme_next;		/* freelist link (frame index) */
+	int32_t cme_prev;		/* freelist link (frame index) */
+	uint32_t cme_npages;		/* run length, at head of a run */
+	uint16_t cme_refcount;		/* address spaces mapping the frame */
+	uint8_t cme_order;		/* block order, at head of a free block */
+	uint8_t cme_free:1;		/* head of a free block */
+	uint8_t cme_head:1;		/* head of an allocated run */
+	uint8_t cme_used:1;		/* frame is allocated */
+	uint8_t cme_busy:1;		/* being evicted */
+	uint8_t cme_stable:1;		/* write-protected for merging */
+	uint8_t cme_merged:1;		/* other pages were merged into it */
+	struct addrspace *cme_as;	/* evictable user page: owner... */
+	vaddr_t cme_vaddr;		/* ...and its address */
+	unsigned cme_swapslot;		/* copy in swap, or SWAP_NOSLOT */
+	struct vnode *cme_vnode;	/* text cache: file, or NULL... */
+	uint32_t cme_filepage;		/* ...page number within it... */
+	int32_t cme_hnext;		/* ...and hash chain link */
+};
+
+static struct coremap_entry *coremap = NULL;
+static volatile uint8_t *frame_refbits = NULL;	/* clock reference bits */
+static paddr_t coremap_base = 0;	/* paddr of frame 0 */
+static unsigned int coremap_size = 0;	/* number of managed frames */
+static unsigned int coremap_nfree = 0;
+static int32_t freelists[COREMAP_NORDERS];
 static bool coremap_created = false;
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static unsigned int coremap_lock_count = 0;	/* times coremap_lock taken */
 static struct spinlock pagetable_lock = SPINLOCK_INITIALIZER;
+static struct lock *evict_lock = NULL;	/* one eviction at a time */
+static uint32_t clock_hand = 0;		/* next frame the clock looks at */
+static unsigned int vm_nevictions = 0;	/* frames reclaimed by the clock */
+static struct lock *shm_lock = NULL;	/* shm_objects; see shm_attach */
+static struct shm_object *shm_files = NULL;	/* objects of mapped files */
+static unsigned int vm_shared_pages = 0;	/* charged to shm_objects */
+static unsigned int vm_shared_limit = 0;	/* most that may be */
+static unsigned int vm_faultaround = FAULTAROUND_DEFAULT;  /* 0 if off */
+
+#define TEXTCACHE_BUCKETS 256
+static int32_t textcache[TEXTCACHE_BUCKETS];	/* hash chain heads */
+static unsigned int textcache_npages = 0;	/* frames in the text cache */
+
+/*
+ * Used by the TLB refill fast path in exception-mips1.S: each cpu's
+ * current first-level page table (0 if none), and frame_refbits[]
+ * biased so it can be indexed by physical page number.
+ */
+vaddr_t cpupagetables[MAXCPUS];
+vaddr_t vm_refbase;
+
+static
+void
+freelist_insert(int32_t idx, unsigned order)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	e->cme_free = 1;
+	e->cme_order = order;
+	e->cme_prev = COREMAP_NOFRAME;
+	e->cme_next = freelists[order];
+	if (freelists[order] != COREMAP_NOFRAME) {
+		coremap[freelists[order]].cme_prev = idx;
+	}
+	freelists[order] = idx;
+}
+
+static
+void
+freelist_remove(int32_t idx)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	KASSERT(e->cme_free);
+	if (e->cme_prev != COREMAP_NOFRAME) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		freelists[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next != COREMAP_NOFRAME) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_free = 0;
+	e->cme_next = e->cme_prev = COREMAP_NOFRAME;
+}
+
+/*
+ * Put the block of 2^order frames at IDX back on the free lists,
+ * merging with its buddy for as long as the buddy is free too.
+ */
+static
+void
+buddy_free_block(int32_t idx, unsigned order)
+{
+	uint32_t buddy;
+
+	while (order + 1 < COREMAP_NORDERS) {
+		buddy = (uint32_t)idx ^ (1U << order);
+		if (buddy >= coremap_size || !coremap[buddy].cme_free ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if ((int32_t)buddy < idx) {
+			idx = buddy;
+		}
+		order++;
+	}
+	freelist_insert(idx, order);
+}
+
+/*
+ * Release NPAGES frames starting at IDX, splitting the range into
+ * the largest aligned blocks it contains.
+ */
+static
+void
+buddy_free_run(uint32_t idx, uint32_t npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order + 1 < COREMAP_NORDERS &&
+		       (idx & ((1U << (order + 1)) - 1)) == 0 &&
+		       (1U << (order + 1)) <= npages) {
+			order++;
+		}
+		buddy_free_block(idx, order);
+		idx += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+void
+vm_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned int nframes, cmpages, i;
+
+	ram_getsize(&lo, &hi);
+	nframes = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(nframes * (sizeof(struct coremap_entry) + 1),
+			     PAGE_SIZE);
+	KASSERT(cmpages < nframes);
+
+	coremap = (struct coremap_entry *) PADDR_TO_KVADDR(lo);
+	coremap_base = lo + cmpages * PAGE_SIZE;
+	coremap_size = nframes - cmpages;
+	frame_refbits = (uint8_t *)&coremap[nframes];
+	vm_refbase = (vaddr_t)frame_refbits - coremap_base / PAGE_SIZE;
+
+	for (i = 0; i < COREMAP_NORDERS; i++) {
+		freelists[i] = COREMAP_NOFRAME;
+	}
+	for (i = 0; i < TEXTCACHE_BUCKETS; i++) {
+		textcache[i] = COREMAP_NOFRAME;
+	}
+	for (i = 0; i < coremap_size; i++) {
+		coremap[i].cme_next = COREMAP_NOFRAME;
+		coremap[i].cme_prev = COREMAP_NOFRAME;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_free = 0;
+		coremap[i].cme_head = 0;
+		coremap[i].cme_used = 0;
+		coremap[i].cme_busy = 0;
+		coremap[i].cme_stable = 0;
+		coremap[i].cme_merged = 0;
+		frame_refbits[i] = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_swapslot = SWAP_NOSLOT;
+		coremap[i].cme_vnode = NULL;
+		coremap[i].cme_filepage = 0;
+		coremap[i].cme_hnext = COREMAP_NOFRAME;
+	}
+	buddy_free_run(0, coremap_size);
+	coremap_nfree = coremap_size;
+	vm_shared_limit = coremap_size * SHARED_LIMIT_PERCENT / 100;
+
+	coremap_created = true;
+
+	evict_lock = lock_create("evict");
+	if (evict_lock == NULL) {
+		panic("vm_bootstrap: out of memory for evict lock\n");
+	}
+	shm_lock = lock_create("shm");
+	if (shm_lock == NULL) {
+		panic("vm_bootstrap: out of memory for shm lock\n");
+	}
+
+	vmstats_init();
+}
+
+paddr_t 
+coremap_stealmem(unsigned long npages) 
+{
+	unsigned order, k;
+	int32_t idx;
+	uint32_t i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages == 0 || npages > coremap_nfree) {
+		return 0;
+	}
+
+	/* smallest order that holds npages */
+	for (order = 0; (1UL << order) < npages; order++) {
+		if (order + 1 == COREMAP_NORDERS) {
+			return 0;
+		}
+	}
+
+	for (k = order; k < COREMAP_NORDERS; k++) {
+		if (freelists[k] != COREMAP_NOFRAME) {
+			break;
+		}
+	}
+	if (k == COREMAP_NORDERS) {
+		return 0;
+	}
+
+	idx = freelists[k];
+	freelist_remove(idx);
+
+	/* split down to the order we need, freeing the upper halves */
+	while (k > order) {
+		k--;
+		freelist_insert(idx + (1 << k), k);
+	}
+
+	/* give back the tail past npages */
+	buddy_free_run(idx + npages, (1U << order) - npages);
+
+	for (i = 0; i < npages; i++) {
+		coremap[idx + i].cme_used = 1;
+		coremap[idx + i].cme_head = 0;
+	}
+	coremap[idx].cme_head = 1;
+	coremap[idx].cme_npages = npages;
+	coremap[idx].cme_refcount = 1;
+	coremap_nfree -= npages;
+
+	return coremap_base + (paddr_t)idx * PAGE_SIZE;
+}
+
+/*
+ * Return the run starting at PADDR to the buddy allocator.
+ * Frames below coremap_base were stolen before vm_bootstrap and are
+ * not managed; they are leaked, as dumbvm always did.
+ */
+static
+void
+coremap_freemem(paddr_t paddr)
+{
+	uint32_t idx, npages, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (paddr < coremap_base) {
+		return;
+	}
+	KASSERT((paddr & ~(paddr_t)PAGE_FRAME) == 0);
+	idx = (paddr - coremap_base) / PAGE_SIZE;
+	KASSERT(idx < coremap_size);
+	KASSERT(coremap[idx].cme_head && coremap[idx].cme_used);
+
+	npages = coremap[idx].cme_npages;
+	for (i = 0; i < npages; i++) {
+		coremap[idx + i].cme_used = 0;
+		coremap[idx + i].cme_head = 0;
+	}
+	coremap[idx].cme_npages = 0;
+	coremap_nfree += npages;
+
+	buddy_free_run(idx, npages);
+}
+
+static
+void
+coremap_acquire(void)
+{
+	spinlock_acquire(&coremap_lock);
+	coremap_lock_count++;
+}
+
+static
+void
+coremap_release(void)
+{
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Per-cpu page magazines.
+ *
+ * Almost every allocation is a single page (all user pages come
+ * through getppages(1)), so each cpu keeps a small stack of free
+ * frames in struct cpu and serves single-page allocs and frees from
+ * it without touching coremap_lock. When the magazine is empty we
+ * refill PAGEMAG_BATCH frames under one lock hold; when it is full we
+ * drain PAGEMAG_BATCH frames the same way.
+ *
+ * Frames in a magazine stay marked allocated (as one-page runs) in
+ * the coremap. Each magazine has a lock of its own, c_pagemag_lock,
+ * taken before coremap_lock. Its cpu is nearly the only one to take
+ * it, so it is almost never contended; it is there so pagemag_drain
+ * can empty other cpus' magazines. A thread that migrates after
+ * looking up curcpu just works on the magazine of the cpu it left.
+ */
+static
+paddr_t
+pagemag_alloc(void)
+{
+	struct cpu *c;
+	paddr_t pa;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pagemag_lock);
+
+	if (c->c_pagemag_count > 0) {
+		c->c_pagemag_hits++;
+	}
+	else {
+		c->c_pagemag_misses++;
+		coremap_acquire();
+		while (c->c_pagemag_count < PAGEMAG_BATCH) {
+			pa = coremap_stealmem(1);
+			if (pa == 0) {
+				break;
+			}
+			c->c_pagemag[c->c_pagemag_count++] = pa;
+		}
+		coremap_release();
+		if (c->c_pagemag_count == 0) {
+			spinlock_release(&c->c_pagemag_lock);
+			return 0;
+		}
+	}
+
+	pa = c->c_pagemag[--c->c_pagemag_count];
+	spinlock_release(&c->c_pagemag_lock);
+
+	/* the frame is ours now; reset what a previous owner left */
+	coremap[(pa - coremap_base) / PAGE_SIZE].cme_refcount = 1;
+	return pa;
+}
+
+static
+void
+pagemag_free(paddr_t pa)
+{
+	struct cpu *c;
+	unsigned i;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pagemag_lock);
+
+	if (c->c_pagemag_count == PAGEMAG_SIZE) {
+		coremap_acquire();
+		for (i = 0; i < PAGEMAG_BATCH; i++) {
+			coremap_freemem(c->c_pagemag[--c->c_pagemag_count]);
+		}
+		coremap_release();
+	}
+	c->c_pagemag[c->c_pagemag_count++] = pa;
+
+	spinlock_release(&c->c_pagemag_lock);
+}
+
+/*
+ * Give everything in every cpu's magazine back to the coremap, so a
+ * multi-page run that failed can be retried against coalesced blocks.
+ * Returns true if anything was given back.
+ */
+static
+bool
+pagemag_drain(void)
+{
+	struct cpu *c;
+	unsigned i, n;
+	bool drained;
+
+	drained = false;
+	n = cpu_numcpus();
+	for (i = 0; i < n; i++) {
+		c = cpu_getcpu(i);
+		spinlock_acquire(&c->c_pagemag_lock);
+		if (c->c_pagemag_count > 0) {
+			drained = true;
+			coremap_acquire();
+			while (c->c_pagemag_count > 0) {
+				coremap_freemem(
+				    c->c_pagemag[--c->c_pagemag_count]);
+			}
+			coremap_release();
+		}
+		spinlock_release(&c->c_pagemag_lock);
+	}
+	return drained;
+}
+
+/*
+ * Pre-zeroed frames.
+ *
+ * Every page a process touches for the first time has to be zeroed,
+ * and doing that in the fault handler puts it on the path of every
+ * exec, fork and heap or stack growth. Instead, cpus with nothing to
+ * run zero frames ahead of time (vm_idle) into a small global pool,
+ * and as_fill_page takes from the pool before falling back to getting
+ * a frame and zeroing it itself.
+ *
+ * Refilling starts once the pool falls to ZEROPOOL_LOW and goes on
+ * until it holds ZEROPOOL_HIGH, so idle cpus work in bursts rather
+ * than one frame at a time. It never takes frames when free memory
+ * is short, and getppages takes frames back out of the pool before
+ * resorting to eviction.
+ */
+static paddr_t zeropool[ZEROPOOL_HIGH];
+static unsigned zeropool_count = 0;
+static bool zeropool_refill = true;
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Take a zeroed frame, with one reference, or return 0 if there are
+ * none.
+ */
+static
+paddr_t
+zeropool_take(void)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&zeropool_lock);
+	pa = 0;
+	if (zeropool_count > 0) {
+		pa = zeropool[--zeropool_count];
+	}
+	if (zeropool_count <= ZEROPOOL_LOW) {
+		zeropool_refill = true;
+	}
+	spinlock_release(&zeropool_lock);
+
+	vmstats_inc(pa != 0 ? VMSTAT_ZEROPOOL_HIT : VMSTAT_ZEROPOOL_MISS);
+	return pa;
+}
+
+/*
+ * Give every frame in the pool back to this cpu's magazine, when
+ * memory is needed for something else. Refilling waits until the
+ * pool is next used.
+ */
+static
+void
+zeropool_drain(void)
+{
+	paddr_t pa;
+
+	while (1) {
+		spinlock_acquire(&zeropool_lock);
+		if (zeropool_count == 0) {
+			spinlock_release(&zeropool_lock);
+			break;
+		}
+		pa = zeropool[--zeropool_count];
+		zeropool_refill = false;
+		spinlock_release(&zeropool_lock);
+		pagemag_free(pa);
+	}
+}
+
+/*
+ * Number of free frames, for tests and statistics. Frames cached in
+ * the per-cpu magazines are not counted.
+ */
+unsigned int
+coremap_freeframes(void)
+{
+	unsigned int n;
+
+	spinlock_acquire(&coremap_lock);
+	n = coremap_nfree;
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned i, n, order, nblocks[COREMAP_NORDERS];
+	unsigned hits, misses, cached, totalhits = 0, totalmisses = 0;
+	unsigned nfree, lockcount, swapused, swaptotal, ntext, poolpages;
+	size_t poolbytes, poolmax;
+	struct cpu *c;
+	int32_t idx;
+
+	spinlock_acquire(&coremap_lock);
+	nfree = coremap_nfree;
+	lockcount = coremap_lock_count;
+	ntext = textcache_npages;
+	for (order = 0; order < COREMAP_NORDERS; order++) {
+		nblocks[order] = 0;
+		for (idx = freelists[order]; idx != COREMAP_NOFRAME;
+		     idx = coremap[idx].cme_next) {
+			nblocks[order]++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Coremap: %u frames, %u free, %u in the text cache\n",
+		coremap_size, nfree, ntext);
+	/* unlocked peek; it's only statistics */
+	kprintf("Shared mappings: %u of %u pages charged\n",
+		vm_shared_pages, vm_shared_limit);
+	for (order = 0; order < COREMAP_NORDERS; order++) {
+		if (nblocks[order] > 0) {
+			kprintf("   order %2u (%6u pages): %u free blocks\n",
+				order, 1U << order, nblocks[order]);
+		}
+	}
+
+	n = cpu_numcpus();
+	for (i = 0; i < n; i++) {
+		c = cpu_getcpu(i);
+		hits = c->c_pagemag_hits;
+		misses = c->c_pagemag_misses;
+		cached = c->c_pagemag_count;
+		totalhits += hits;
+		totalmisses += misses;
+		kprintf("cpu%u: magazine %u cached, %u hits, %u misses "
+			"(%u%% hit rate)\n", i, cached, hits, misses,
+			hits + misses ? (hits * 100) / (hits + misses) : 0);
+	}
+	kprintf("Magazine hit rate: %u%%, coremap lock acquisitions: %u\n",
+		totalhits + totalmisses ?
+		(totalhits * 100) / (totalhits + totalmisses) : 0,
+		lockcount);
+
+	if (swap_enabled()) {
+		swap_usage(&swapused, &swaptotal);
+		kprintf("Swap: %u of %u slots used, %u evictions\n",
+			swapused, swaptotal, vm_nevictions);
+		swap_poolusage(&poolpages, &poolbytes, &poolmax);
+		kprintf("Compressed pool: %u pages in %uK of %uK\n",
+			poolpages, poolbytes / 1024, poolmax / 1024);
+	}
+}
+
+/*
+ * True if free frames are getting scarce, so work done ahead of time
+ * (zeroing, fault-around) should not use them up. An unlocked peek is
+ * good enough for that.
+ */
+static
+bool
+vm_memory_low(void)
+{
+	return coremap_nfree <= 2 * ZEROPOOL_HIGH;
+}
+
+/*
+ * Called by an idle cpu, with interrupts off, before it waits for an
+ * interrupt. Zeroes one frame for the pool if the pool wants one, and
+ * returns true if it did, so the caller can look for work again
+ * before doing another.
+ */
+bool
+vm_idle(void)
+{
+	paddr_t pa;
+	bool want;
+
+	if (!coremap_created) {
+		return false;
+	}
+
+	spinlock_acquire(&zeropool_lock);
+	want = zeropool_refill;
+	spinlock_release(&zeropool_lock);
+	if (!want || vm_memory_low()) {
+		return false;
+	}
+
+	pa = pagemag_alloc();
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count < ZEROPOOL_HIGH) {
+		zeropool[zeropool_count++] = pa;
+		pa = 0;
+	}
+	if (zeropool_count == ZEROPOOL_HIGH) {
+		zeropool_refill = false;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (pa != 0) {
+		/* another cpu filled it first */
+		pagemag_free(pa);
+		return false;
+	}
+	vmstats_inc(VMSTAT_ZEROPOOL_FILL);
+	return true;
+}
+
+static bool vm_can_evict(void);
+static paddr_t vm_evict(void);
+#else
+void
+vm_bootstrap(void)
+{
+	/* Do nothing. */
+}
+
+bool
+vm_idle(void)
+{
+	return false;
+}
 #endif
 
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+#if OPT_A3
+	unsigned long i;
+
+	if (coremap_created) {
+		if (npages == 1) {
+			addr = pagemag_alloc();
+			if (addr == 0) {
+				/* zeroed is as good as free */
+				zeropool_drain();
+				addr = pagemag_alloc();
+			}
+			if (addr == 0 && vm_can_evict()) {
+				/* compressed swap pages given up since */
+				swap_reap();
+				addr = pagemag_alloc();
+			}
+			if (addr == 0 && vm_can_evict()) {
+				addr = vm_evict();
+			}
+			return addr;
+		}
+
+		coremap_acquire();
+		addr = coremap_stealmem(npages);
+		coremap_release();
+
+		if (addr == 0) {
+			zeropool_drain();
+			if (vm_can_evict()) {
+				swap_reap();
+			}
+		}
+		if (addr == 0 && pagemag_drain()) {
+			coremap_acquire();
+			addr = coremap_stealmem(npages);
+			coremap_release();
+		}
+
+		/*
+		 * Page out enough to make room and try once more. The
+		 * evicted frames may not coalesce into a run this long,
+		 * so this can still fail.
+		 */
+		if (addr == 0 && vm_can_evict()) {
+			for (i = 0; i < npages; i++) {
+				addr = vm_evict();
+				if (addr == 0) {
+					break;
+				}
+				free_kpages(PADDR_TO_KVADDR(addr));
+			}
+			pagemag_drain();
+			coremap_acquire();
+			addr = coremap_stealmem(npages);
+			coremap_release();
+		}
+	} else {
+		spinlock_acquire(&stealmem_lock);
+
+        	addr = ram_stealmem(npages);
+
+        	spinlock_release(&stealmem_lock);
+	}
+#else
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+	
+	spinlock_release(&stealmem_lock);
+#endif
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+#if OPT_A3
+	if (!coremap_created) {
+		/* stolen before vm_bootstrap; leak it */
+		return;
+	}
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	if (paddr < coremap_base) {
+		return;
+	}
+	/* the caller owns the run, so its length can't change under us */
+	if (coremap[(paddr - coremap_base) / PAGE_SIZE].cme_npages == 1) {
+		pagemag_free(paddr);
+		return;
+	}
+	coremap_acquire();
+	coremap_freemem(paddr);
+	coremap_release();
+#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+#endif
+}
+
+#if OPT_A3
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of the address space they
+ * belong to, so switching address spaces only means loading another
+ * ASID into EntryHi, not flushing the TLB. Each cpu hands out ASIDs
+ * on its own (c_asid_last) and an address space remembers the one it
+ * got on each cpu (as_asids). The bits above the hardware ASID count
+ * generations: when a cpu has used all 64 it flushes its TLB and
+ * starts a new generation, which invalidates every ASID it handed
+ * out before.
+ */
+
+/* Does ASID belong to cpu C's current generation? */
+#define ASID_CURRENT(c, asid) \
+	((((asid) ^ (c)->c_asid_last) & ~ASID_MASK) == 0)
+
+#define ASID_TLBHI(asid)  (((asid) & ASID_MASK) << TLBHI_PIDSHIFT)
+
+/*
+ * Make ASID the one the processor matches user addresses against.
+ * tlb_probe loads EntryHi and has no other lasting effect. Called
+ * with interrupts off.
+ */
+static
+void
+tlb_setasid(uint32_t asid)
+{
+	(void)tlb_probe(TLBHI_INVALID(0) | ASID_TLBHI(asid), 0);
+}
+
+/*
+ * Load a translation for VADDR in the current address space into the
+ * TLB. If the page already has an entry (e.g. a read-only one we are
+ * upgrading) overwrite it, since the TLB must never hold two entries
+ * for the same page. MISS says whether this is a TLB miss, for the
+ * free/replace statistics.
+ */
+static
+void
+tlb_load(vaddr_t vaddr, uint32_t elo, bool miss)
+{
+	uint32_t ehi, oehi, oelo;
+	int i, spl;
+
+	spl = splhigh();
+
+	ehi = vaddr | ASID_TLBHI(curcpu->c_asid);
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		if (miss) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&oehi, &oelo, i);
+		if (oelo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		if (miss) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+		return;
+	}
+
+	tlb_random(ehi, elo);
+	splx(spl);
+	if (miss) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+}
+
+/* Invalidate every entry in this cpu's TLB. */
+static
+void
+tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+}
+
+/*
+ * Invalidate this cpu's TLB entry for VADDR in the address space
+ * with ASID, if it has one.
+ */
+static
+void
+tlb_invalidate(vaddr_t vaddr, uint32_t asid)
+{
+	int i, spl;
+
+	spl = splhigh();
+	if (ASID_CURRENT(curcpu, asid)) {
+		i = tlb_probe(vaddr | ASID_TLBHI(asid), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setasid(curcpu->c_asid);
+	}
+	splx(spl);
+}
+
+/*
+ * TLB shootdown.
+ *
+ * tlb_shootdown removes any translation for NPAGES pages of AS
+ * starting at VADDR from every cpu's TLB. Only cpus on which AS has
+ * an ASID of the current generation can hold one, and of those only
+ * a cpu that is running AS (c_lastas) needs an interrupt: elsewhere
+ * we just retire AS's ASID, which strands its old entries until the
+ * cpu's next rollover flushes them, and AS gets a fresh ASID when it
+ * next runs there. A cpu that does need interrupting gets one IPI per
+ * page, or a single full flush if there are more than
+ * TLBSHOOTDOWN_MAX.
+ *
+ * Called with pagetable_lock, which keeps AS from going away. The
+ * IPIs are only sent; the caller must let go of pagetable_lock and
+ * then call tlb_shootdown_wait before reusing or writing out the
+ * frames, because the target may be spinning on pagetable_lock with
+ * interrupts off.
+ */
+struct tlb_wait {
+	unsigned tw_ncpus;
+	struct cpu *tw_cpu[MAXCPUS];
+	unsigned tw_ticket[MAXCPUS];
+	time_t tw_secs;
+	uint32_t tw_nsecs;
+};
+
+static
+void
+tlb_wait_init(struct tlb_wait *tw)
+{
+	tw->tw_ncpus = 0;
+}
+
+static
+void
+tlb_shootdown(struct addrspace *as, vaddr_t vaddr, unsigned npages,
+	      struct tlb_wait *tw)
+{
+	struct tlbshootdown ts;
+	struct cpu *c;
+	uint32_t asid;
+	unsigned i, j, n, ticket;
+
+	KASSERT(spinlock_do_i_hold(&pagetable_lock));
+
+	n = cpu_numcpus();
+	for (i = 0; i < n; i++) {
+		asid = as->as_asids[i];
+		if (asid == 0) {
+			continue;
+		}
+		c = cpu_getcpu(i);
+		if (!ASID_CURRENT(c, asid)) {
+			/* rolled over since; the entries are gone */
+			continue;
+		}
+		if (c == curcpu->c_self) {
+			if (npages > TLBSHOOTDOWN_MAX) {
+				tlb_flush();
+				vmstats_inc(VMSTAT_TLB_INVALIDATE);
+			}
+			else {
+				for (j = 0; j < npages; j++) {
+					tlb_invalidate(vaddr + j * PAGE_SIZE,
+						       asid);
+				}
+			}
+			continue;
+		}
+
+		if (c->c_lastas != as) {
+			as->as_asids[i] = 0;
+			if (c->c_lastas != as) {
+				continue;
+			}
+			/* it switched to AS meanwhile: interrupt it */
+		}
+
+		if (tw->tw_ncpus == 0) {
+			gettime(&tw->tw_secs, &tw->tw_nsecs);
+		}
+		if (npages > TLBSHOOTDOWN_MAX) {
+			ticket = ipi_tlbshootdown_all(c);
+			vmstats_inc(VMSTAT_TLB_SHOOTDOWN_ALL);
+		}
+		else {
+			ts.ts_addrspace = as;
+			ts.ts_asid = asid;
+			ticket = 0;
+			for (j = 0; j < npages; j++) {
+				ts.ts_vaddr = vaddr + j * PAGE_SIZE;
+				ticket = ipi_tlbshootdown(c, &ts);
+			}
+		}
+		vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+
+		for (j = 0; j < tw->tw_ncpus; j++) {
+			if (tw->tw_cpu[j] == c) {
+				break;
+			}
+		}
+		if (j == tw->tw_ncpus) {
+			tw->tw_cpu[j] = c;
+			tw->tw_ncpus++;
+		}
+		tw->tw_ticket[j] = ticket;
+	}
+}
+
+/*
+ * Wait until every cpu interrupted by tlb_shootdown has done its
+ * invalidations, and account the time it took.
+ */
+static
+void
+tlb_shootdown_wait(struct tlb_wait *tw)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i;
+
+	if (tw->tw_ncpus == 0) {
+		return;
+	}
+	for (i = 0; i < tw->tw_ncpus; i++) {
+		ipi_tlbshootdown_wait(tw->tw_cpu[i], tw->tw_ticket[i]);
+	}
+	gettime(&secs, &nsecs);
+	getinterval(tw->tw_secs, tw->tw_nsecs, secs, nsecs, &secs, &nsecs);
+	vmstats_add(VMSTAT_TLB_SHOOTDOWN_USEC, secs * 1000000 + nsecs / 1000);
+	tw->tw_ncpus = 0;
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	tlb_flush();
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	tlb_invalidate(ts->ts_vaddr, ts->ts_asid);
+	/*
+	 * If the address space got a new ASID here after the sender
+	 * read the old one (see as_activate), go by the new one.
+	 */
+	if (curcpu->c_lastas == ts->ts_addrspace &&
+	    curcpu->c_asid != ts->ts_asid) {
+		tlb_invalidate(ts->ts_vaddr, curcpu->c_asid);
+	}
+}
+#else
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+#endif
+
+#if OPT_A3
+/*
+ * Frame reference counts.
+ *
+ * A frame shared copy-on-write by several address spaces is
+ * referenced once by each of them. getppages hands frames out with
+ * one reference; the frame goes back to the allocator when the last
+ * reference is dropped.
+ */
+static
+struct coremap_entry *
+frame_entry(paddr_t paddr)
+{
+	uint32_t idx;
+
+	KASSERT(paddr >= coremap_base);
+	idx = (paddr - coremap_base) / PAGE_SIZE;
+	KASSERT(idx < coremap_size);
+	KASSERT(coremap[idx].cme_used);
+	return &coremap[idx];
+}
+
+static
+unsigned
+frame_refcount(paddr_t paddr)
+{
+	unsigned rc;
+
+	coremap_acquire();
+	rc = frame_entry(paddr)->cme_refcount;
+	coremap_release();
+	return rc;
+}
+
+/*
+ * The text cache.
+ *
+ * Processes running the same program would otherwise each read its
+ * text into frames of their own. Instead, a frame holding a whole
+ * page of a file that is mapped read-only is entered in a hash table
+ * keyed by (vnode, page of the file), and the next fault on that page
+ * of that file in any address space takes another reference to the
+ * same frame. Since the page is never written, sharing it is safe
+ * whatever the region it is mapped into.
+ *
+ * The cache holds no references of its own: a frame leaves it when
+ * it is freed or evicted. So the vnode of a cached frame is always
+ * still referenced by whoever maps the frame. The chains are linked
+ * through the coremap and protected by coremap_lock.
+ */
+static
+unsigned
+textcache_hash(struct vnode *vn, uint32_t filepage)
+{
+	return ((uintptr_t)vn / sizeof(struct vnode) + filepage) %
+		TEXTCACHE_BUCKETS;
+}
+
+/*
+ * Look for page FILEPAGE of VN. If it is cached, and not on its way
+ * out, take a reference to its frame and return it; otherwise return
+ * 0.
+ */
+static
+paddr_t
+textcache_lookup(struct vnode *vn, uint32_t filepage)
+{
+	struct coremap_entry *e;
+	int32_t idx;
+	paddr_t paddr;
+
+	paddr = 0;
+	coremap_acquire();
+	for (idx = textcache[textcache_hash(vn, filepage)];
+	     idx != COREMAP_NOFRAME; idx = e->cme_hnext) {
+		e = &coremap[idx];
+		if (e->cme_vnode == vn && e->cme_filepage == filepage) {
+			if (!e->cme_busy) {
+				KASSERT(e->cme_refcount > 0);
+				e->cme_refcount++;
+				paddr = coremap_base +
+					(paddr_t)idx * PAGE_SIZE;
+			}
+			break;
+		}
+	}
+	coremap_release();
+	return paddr;
+}
+
+/*
+ * Enter the frame at PADDR, which holds page FILEPAGE of VN, unless
+ * that page is already cached.
+ */
+static
+void
+textcache_insert(paddr_t paddr, struct vnode *vn, uint32_t filepage)
+{
+	struct coremap_entry *e;
+	unsigned h;
+	int32_t idx;
+
+	h = textcache_hash(vn, filepage);
+	coremap_acquire();
+	for (idx = textcache[h]; idx != COREMAP_NOFRAME;
+	     idx = coremap[idx].cme_hnext) {
+		if (coremap[idx].cme_vnode == vn &&
+		    coremap[idx].cme_filepage == filepage) {
+			coremap_release();
+			return;
+		}
+	}
+	e = frame_entry(paddr);
+	KASSERT(e->cme_vnode == NULL);
+	e->cme_vnode = vn;
+	e->cme_filepage = filepage;
+	e->cme_hnext = textcache[h];
+	textcache[h] = e - coremap;
+	textcache_npages++;
+	coremap_release();
+}
+
+/*
+ * Take frame E out of the cache, if it is in it. Called with
+ * coremap_lock.
+ */
+static
+void
+textcache_remove(struct coremap_entry *e)
+{
+	int32_t *link;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (e->cme_vnode == NULL) {
+		return;
+	}
+	link = &textcache[textcache_hash(e->cme_vnode, e->cme_filepage)];
+	while (*link != e - coremap) {
+		KASSERT(*link != COREMAP_NOFRAME);
+		link = &coremap[*link].cme_hnext;
+	}
+	*link = e->cme_hnext;
+	e->cme_hnext = COREMAP_NOFRAME;
+	e->cme_vnode = NULL;
+	e->cme_filepage = 0;
+	textcache_npages--;
+}
+
+/*
+ * Page FILEPAGE of VN is being written: stop handing out the cached
+ * copy. Frames already mapped keep the old contents.
+ */
+static
+void
+textcache_forget(struct vnode *vn, uint32_t filepage)
+{
+	int32_t idx;
+
+	coremap_acquire();
+	for (idx = textcache[textcache_hash(vn, filepage)];
+	     idx != COREMAP_NOFRAME; idx = coremap[idx].cme_hnext) {
+		if (coremap[idx].cme_vnode == vn &&
+		    coremap[idx].cme_filepage == filepage) {
+			textcache_remove(&coremap[idx]);
+			break;
+		}
+	}
+	coremap_release();
+}
+
+/*
+ * Drop AS's reference to a frame. If AS was the frame's recorded
+ * owner it no longer is: the frame can't be evicted until somebody
+ * claims it again (frame_setowner). A frame that is being evicted
+ * when its last reference goes away is left for vm_evict to reclaim.
+ */
+static
+void
+frame_decref(struct addrspace *as, paddr_t paddr)
+{
+	struct coremap_entry *e;
+	unsigned rc, slot;
+	bool busy;
+
+	coremap_acquire();
+	e = frame_entry(paddr);
+	KASSERT(e->cme_refcount > 0);
+	rc = --e->cme_refcount;
+	if (rc == 0 || e->cme_as == as) {
+		e->cme_as = NULL;
+	}
+	busy = e->cme_busy;
+	slot = SWAP_NOSLOT;
+	if (rc == 0 && !busy) {
+		slot = e->cme_swapslot;
+		e->cme_swapslot = SWAP_NOSLOT;
+		e->cme_stable = 0;
+		e->cme_merged = 0;
+		textcache_remove(e);
+	}
+	coremap_release();
+
+	if (rc == 0 && !busy) {
+		if (slot != SWAP_NOSLOT) {
+			swap_free(slot);
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+/*
+ * Sort N frame addresses into ascending order (Shell sort; there is
+ * no qsort in the kernel, and N is at most a page table's worth).
+ */
+static
+void
+frame_sort(paddr_t *frames, unsigned n)
+{
+	unsigned gap, i, j;
+	paddr_t pa;
+
+	for (gap = n / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			pa = frames[i];
+			for (j = i; j >= gap && frames[j - gap] > pa; j -= gap) {
+				frames[j] = frames[j - gap];
+			}
+			frames[j] = pa;
+		}
+	}
+}
+
+/*
+ * Drop AS's reference to each of the N frames in FRAMES, as
+ * frame_decref does, but under a single hold of coremap_lock. Frames
+ * whose last reference goes away go straight back to the buddy lists
+ * rather than through the page magazines, and runs of adjacent frames
+ * are freed together so they coalesce in one pass. FRAMES is used as
+ * scratch space and is left sorted.
+ *
+ * Exiting or exec'ing a large process used to take coremap_lock once
+ * per frame here; now it takes it once per second-level page table.
+ */
+static
+void
+frame_decref_batch(struct addrspace *as, paddr_t *frames, unsigned n)
+{
+	struct coremap_entry *e;
+	uint32_t idx, start, run;
+	unsigned i, nfree;
+
+	if (n == 0) {
+		return;
+	}
+	frame_sort(frames, n);
+
+	coremap_acquire();
+	nfree = 0;
+	for (i = 0; i < n; i++) {
+		e = frame_entry(frames[i]);
+		KASSERT(e->cme_refcount > 0);
+		e->cme_refcount--;
+		if (e->cme_refcount == 0 || e->cme_as == as) {
+			e->cme_as = NULL;
+		}
+		if (e->cme_refcount > 0 || e->cme_busy) {
+			/* still mapped, or left for vm_evict to reclaim */
+			continue;
+		}
+		KASSERT(e->cme_head && e->cme_npages == 1);
+		if (e->cme_swapslot != SWAP_NOSLOT) {
+			/* swap_lock is a leaf, so this is safe here */
+			swap_free(e->cme_swapslot);
+			e->cme_swapslot = SWAP_NOSLOT;
+		}
+		e->cme_stable = 0;
+		e->cme_merged = 0;
+		textcache_remove(e);
+		e->cme_used = 0;
+		e->cme_head = 0;
+		e->cme_npages = 0;
+		frames[nfree++] = frames[i];
+	}
+
+	/* the frames to free are still in order; free them run by run */
+	for (i = 0; i < nfree; i += run) {
+		start = (frames[i] - coremap_base) / PAGE_SIZE;
+		run = 1;
+		while (i + run < nfree) {
+			idx = (frames[i + run] - coremap_base) / PAGE_SIZE;
+			if (idx != start + run) {
+				break;
+			}
+			run++;
+		}
+		coremap_nfree += run;
+		buddy_free_run(start, run);
+	}
+	coremap_release();
+}
+
+/*
+ * Record that the frame at PADDR holds page VADDR of AS, with a copy
+ * in swap slot SLOT if that isn't SWAP_NOSLOT, and so may be evicted.
+ * If AS is its only user, AS may now write it, so it is no longer
+ * stable for page merging. Called with pagetable_lock, once the frame
+ * is in the page table.
+ */
+static
+void
+frame_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+	       unsigned slot)
+{
+	struct coremap_entry *e;
+
+	KASSERT(spinlock_do_i_hold(&pagetable_lock));
+
+	coremap_acquire();
+	e = frame_entry(paddr);
+	if (e->cme_refcount == 1) {
+		/* whoever maps it now may write it */
+		e->cme_stable = 0;
+		e->cme_merged = 0;
+	}
+	e->cme_as = as;
+	e->cme_vaddr = vaddr;
+	if (slot != SWAP_NOSLOT) {
+		KASSERT(e->cme_swapslot == SWAP_NOSLOT);
+		e->cme_swapslot = slot;
+	}
+	coremap_release();
+}
+
+/*
+ * Find the region containing VADDR, or NULL if VADDR is not a valid
+ * user address. The region list is sorted, so this is a binary
+ * search; it is only needed when a page has no frame yet.
+ */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = array_num(as->as_regions);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rg = array_get(as->as_regions, mid);
+		if (vaddr < rg->rg_vbase) {
+			hi = mid;
+		}
+		else if (vaddr >= rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			lo = mid + 1;
+		}
+		else {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * VADDR is in no region of AS. If it is in the space the stack may
+ * grow into, above any other region, extend the stack down to cover
+ * it and return the stack region. Otherwise return NULL.
+ *
+ * The stack is the topmost region, ending at USERSTACK. Only the
+ * thread running in AS changes its regions, so no lock is needed.
+ */
+static
+struct region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *stack, *below;
+	unsigned num;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	num = array_num(as->as_regions);
+	if (num == 0) {
+		return NULL;
+	}
+	stack = array_get(as->as_regions, num - 1);
+	if (stack->rg_vbase + stack->rg_npages * PAGE_SIZE != USERSTACK) {
+		return NULL;
+	}
+	if (vaddr >= stack->rg_vbase ||
+	    vaddr < USERSTACK - DUMBVM_STACKMAXPAGES * PAGE_SIZE) {
+		return NULL;
+	}
+	if (num > 1) {
+		below = array_get(as->as_regions, num - 2);
+		if (below->rg_vbase + below->rg_npages * PAGE_SIZE > vaddr) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_vbase - vaddr) / PAGE_SIZE;
+	stack->rg_vbase = vaddr;
+	return stack;
+}
+
+/*
+ * Find the page table entry for VADDR in AS, or NULL if there is no
+ * second-level table covering it yet. Called with pagetable_lock.
+ */
+static
+paddr_t *
+as_pte(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t *l2;
+
+	KASSERT(spinlock_do_i_hold(&pagetable_lock));
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = as->as_pagetable[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		return NULL;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Make sure there is a second-level table covering VADDR. The table
+ * is allocated without holding pagetable_lock and only published
+ * under it.
+ */
+static
+int
+as_pte_alloc(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned l1 = PT_L1_INDEX(vaddr);
+	paddr_t *l2;
+
+	if (as->as_pagetable[l1] != NULL) {
+		return 0;
+	}
+
+	l2 = kmalloc(PT_L2_ENTRIES * sizeof(paddr_t));
+	if (l2 == NULL) {
+		return ENOMEM;
+	}
+	bzero(l2, PT_L2_ENTRIES * sizeof(paddr_t));
+
+	spinlock_acquire(&pagetable_lock);
+	if (as->as_pagetable[l1] == NULL) {
+		as->as_pagetable[l1] = l2;
+		l2 = NULL;
+	}
+	spinlock_release(&pagetable_lock);
+
+	if (l2 != NULL) {
+		kfree(l2);
+	}
+	return 0;
+}
+
+/*
+ * Shared mappings.
+ *
+ * Every MAP_SHARED region has a shm_object, which holds the frames of
+ * its pages, with a reference to each, for as long as any region uses
+ * it. Fork shares the object along with the region, so parent and
+ * child find the same frames even for pages neither had touched at
+ * the time. All shared mappings of one file use one object, found by
+ * vnode on shm_files and indexed by page of the file, so processes
+ * that map the file separately share frames too and see each other's
+ * writes at once. An anonymous mapping's object is its own, indexed
+ * by page of the mapping.
+ *
+ * munmap, fsync and exit write the pages a region has dirtied back to
+ * the file; the object lets go of the frames once the last region is
+ * gone, and the next mapping of the file reads them from there.
+ *
+ * Shared pages are never evicted, so each object is charged against
+ * vm_shared_limit for all the pages it can hold, and mmap fails with
+ * ENOMEM past the limit. The charge for a file covers its pages from
+ * the start up to the end of the furthest mapping.
+ *
+ * shm_lock protects shm_files, the reference counts, the sizes and the
+ * charge. The frames in so_frames, and so_frames itself, which grows
+ * when a file is mapped further out, are protected by coremap_lock, so
+ * faults can look them up without sleeping. read() and write() don't
+ * go through these frames; if they are added for files, they need to.
+ */
+struct shm_object {
+	struct vnode *so_vnode;		/* file, or NULL if anonymous */
+	unsigned so_refcount;		/* regions using it */
+	unsigned so_npages;		/* pages in so_frames, all charged */
+	paddr_t *so_frames;		/* frame of each page, or 0 */
+	struct shm_object *so_next;	/* on shm_files, if a file's */
+};
+
+/*
+ * Get an object for a new MAP_SHARED mapping of VN (NULL for an
+ * anonymous one) that must be able to hold NPAGES pages: the file's
+ * object if it has one, grown if need be, or a new one.
+ */
+static
+int
+shm_attach(struct vnode *vn, unsigned npages, struct shm_object **ret)
+{
+	struct shm_object *so;
+	paddr_t *frames, *oldframes;
+	unsigned grow;
+
+	lock_acquire(shm_lock);
+	so = NULL;
+	if (vn != NULL) {
+		for (so = shm_files; so != NULL; so = so->so_next) {
+			if (so->so_vnode == vn) {
+				break;
+			}
+		}
+	}
+	if (so != NULL && so->so_npages >= npages) {
+		so->so_refcount++;
+		lock_release(shm_lock);
+		*ret = so;
+		return 0;
+	}
+
+	grow = so != NULL ? npages - so->so_npages : npages;
+	if (grow > vm_shared_limit - vm_shared_pages) {
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+	frames = kmalloc(npages * sizeof(paddr_t));
+	if (frames == NULL) {
+		lock_release(shm_lock);
+		return ENOMEM;
+	}
+	bzero(frames, npages * sizeof(paddr_t));
+
+	if (so == NULL) {
+		so = kmalloc(sizeof(*so));
+		if (so == NULL) {
+			kfree(frames);
+			lock_release(shm_lock);
+			return ENOMEM;
+		}
+		so->so_vnode = vn;
+		so->so_refcount = 0;
+		so->so_npages = npages;
+		so->so_frames = frames;
+		so->so_next = NULL;
+		if (vn != NULL) {
+			so->so_next = shm_files;
+			shm_files = so;
+		}
+	}
+	else {
+		coremap_acquire();
+		memcpy(frames, so->so_frames, so->so_npages * sizeof(paddr_t));
+		oldframes = so->so_frames;
+		so->so_frames = frames;
+		so->so_npages = npages;
+		coremap_release();
+		kfree(oldframes);
+	}
+	vm_shared_pages += grow;
+	so->so_refcount++;
+	lock_release(shm_lock);
+
+	*ret = so;
+	return 0;
+}
+
+static
+void
+shm_incref(struct shm_object *so)
+{
+	lock_acquire(shm_lock);
+	so->so_refcount++;
+	lock_release(shm_lock);
+}
+
+/*
+ * Drop a region's reference to SO. The last one frees its frames; by
+ * then no page table maps them any more.
+ */
+static
+void
+shm_detach(struct shm_object *so)
+{
+	struct shm_object **link;
+	unsigned i;
+
+	lock_acquire(shm_lock);
+	KASSERT(so->so_refcount > 0);
+	so->so_refcount--;
+	if (so->so_refcount > 0) {
+		lock_release(shm_lock);
+		return;
+	}
+	if (so->so_vnode != NULL) {
+		for (link = &shm_files; *link != so; link = &(*link)->so_next) {
+			KASSERT(*link != NULL);
+		}
+		*link = so->so_next;
+	}
+	KASSERT(vm_shared_pages >= so->so_npages);
+	vm_shared_pages -= so->so_npages;
+	lock_release(shm_lock);
+
+	for (i = 0; i < so->so_npages; i++) {
+		if (so->so_frames[i] != 0) {
+			frame_decref(NULL, so->so_frames[i]);
+		}
+	}
+	kfree(so->so_frames);
+	kfree(so);
+}
+
+/* Index in RG's shm_object of the page at VADDR. */
+static
+unsigned
+shm_page(struct region *rg, vaddr_t vaddr)
+{
+	unsigned page;
+
+	KASSERT(rg->rg_shared && rg->rg_shm != NULL);
+
+	page = (vaddr - rg->rg_vbase) / PAGE_SIZE;
+	if (rg->rg_vnode != NULL) {
+		page += rg->rg_fileoffset / PAGE_SIZE;
+	}
+	KASSERT(page < rg->rg_shm->so_npages);
+	return page;
+}
+
+/*
+ * Look for the frame of the page at VADDR in RG, a shared region. If
+ * it has one, take a reference to it and return it; otherwise return
+ * 0.
+ */
+static
+paddr_t
+shm_lookup(struct region *rg, vaddr_t vaddr)
+{
+	struct shm_object *so;
+	paddr_t paddr;
+	unsigned page;
+
+	so = rg->rg_shm;
+	page = shm_page(rg, vaddr);
+	coremap_acquire();
+	paddr = so->so_frames[page];
+	if (paddr != 0) {
+		frame_entry(paddr)->cme_refcount++;
+	}
+	coremap_release();
+	return paddr;
+}
+
+/*
+ * PADDR has just been filled for the page at VADDR in RG, a shared
+ * region, which shm_lookup didn't find. Make it the page's frame and
+ * return it - unless another fault got there first, in which case
+ * drop PADDR and return that one, with a reference.
+ */
+static
+paddr_t
+shm_enter(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct shm_object *so;
+	paddr_t other;
+	unsigned page;
+
+	so = rg->rg_shm;
+	page = shm_page(rg, vaddr);
+	coremap_acquire();
+	other = so->so_frames[page];
+	if (other == 0) {
+		/* the object's own reference */
+		so->so_frames[page] = paddr;
+		frame_entry(paddr)->cme_refcount++;
+		other = paddr;
+	}
+	else {
+		frame_entry(other)->cme_refcount++;
+	}
+	coremap_release();
+
+	if (other != paddr) {
+		frame_decref(NULL, paddr);
+	}
+	return other;
+}
+
+/*
+ * Get a frame for the page at VADDR on its first touch: zero it and,
+ * if the page overlaps the file data of its region, read that part
+ * in from the executable or the mapped file. A read-only page that is
+ * all file data comes from the text cache if it is there, and goes
+ * into it if not. A page of a shared region comes from, or becomes,
+ * the frame its shm_object holds.
+ *
+ * AHEAD is true if nothing has touched the page yet and fault-around
+ * is filling it early; that is counted apart from real page faults.
+ */
+static
+int
+as_fill_page(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	     bool ahead, paddr_t *ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct vnode *vn;
+	vaddr_t start, end;
+	paddr_t paddr;
+	off_t offset;
+	bool cacheable;
+	int result;
+
+	/* part of this page that is backed by the file */
+	start = vaddr > rg->rg_filevaddr ? vaddr : rg->rg_filevaddr;
+	end = vaddr + PAGE_SIZE;
+	if (rg->rg_filesize > 0 && end > rg->rg_filevaddr + rg->rg_filesize) {
+		end = rg->rg_filevaddr + rg->rg_filesize;
+	}
+	offset = rg->rg_fileoffset + (start - rg->rg_filevaddr);
+	vn = rg->rg_vnode != NULL ? rg->rg_vnode : as->as_vnode;
+
+	cacheable = !rg->rg_writeable && !rg->rg_shared &&
+		rg->rg_filesize > 0 && start == vaddr &&
+		end == vaddr + PAGE_SIZE && offset % PAGE_SIZE == 0;
+	if (rg->rg_shared) {
+		paddr = shm_lookup(rg, vaddr);
+		if (paddr != 0) {
+			/* in memory already, like a TLB reload */
+			if (!ahead) {
+				vmstats_inc(VMSTAT_TLB_RELOAD);
+			}
+			*ret = paddr;
+			return 0;
+		}
+	}
+	else if (cacheable) {
+		paddr = textcache_lookup(vn, offset / PAGE_SIZE);
+		if (paddr != 0) {
+			/* in memory already, like a TLB reload */
+			if (!ahead) {
+				vmstats_inc(VMSTAT_TLB_RELOAD);
+			}
+			vmstats_inc(VMSTAT_TEXT_SHARED);
+			*ret = paddr;
+			return 0;
+		}
+	}
+
+	paddr = zeropool_take();
+	if (paddr == 0) {
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	}
+
+	if (rg->rg_filesize == 0 || start >= end) {
+		if (!ahead) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		}
+		if (rg->rg_shared) {
+			paddr = shm_enter(rg, vaddr, paddr);
+		}
+		*ret = paddr;
+		return 0;
+	}
+
+	KASSERT(vn != NULL);
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+		  end - start, offset, UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		if (rg->rg_vnode != NULL) {
+			/* the file shrank since it was mapped */
+			result = EIO;
+		}
+		else {
+			kprintf("ELF: short read on segment - file truncated?\n");
+			result = ENOEXEC;
+		}
+	}
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+
+	if (rg->rg_shared) {
+		paddr = shm_enter(rg, vaddr, paddr);
+	}
+	else if (cacheable) {
+		textcache_insert(paddr, vn, offset / PAGE_SIZE);
+	}
+
+	if (!ahead) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(rg->rg_vnode != NULL ?
+			    VMSTAT_MMAP_FILE_READ : VMSTAT_ELF_FILE_READ);
+	}
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Give the page behind PTE (page VADDR of AS) a private frame after
+ * a write to a copy-on-write page. If nobody else references the
+ * frame any more, just take it over; otherwise copy it into *NEWPA,
+ * which the caller allocated beforehand, and set *NEWPA to 0 to say
+ * it was used. Called with pagetable_lock.
+ */
+static
+void
+as_cow_break(struct addrspace *as, vaddr_t vaddr, paddr_t *pte,
+	     paddr_t *newpa)
+{
+	paddr_t oldpa;
+
+	KASSERT(spinlock_do_i_hold(&pagetable_lock));
+	KASSERT(*pte & PTE_COW);
+
+	oldpa = *pte & PAGE_FRAME;
+	if (frame_refcount(oldpa) == 1) {
+		*pte &= ~PTE_COW;
+		frame_setowner(oldpa, as, vaddr, SWAP_NOSLOT);
+		return;
+	}
+
+	if (frame_entry(oldpa)->cme_merged) {
+		/* racy, but only for the statistics */
+		vmstats_inc(VMSTAT_UNMERGE);
+	}
+	KASSERT(*newpa != 0);
+	memmove((void *)PADDR_TO_KVADDR(*newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = *newpa | (*pte & ~(PAGE_FRAME | PTE_COW));
+	frame_setowner(*newpa, as, vaddr, SWAP_NOSLOT);
+	*newpa = 0;
+	frame_decref(as, oldpa);
+}
+
+/*
+ * Page replacement.
+ *
+ * When there are no free frames getppages evicts one. Victims are
+ * chosen by a clock over the coremap. The hand skips frames that
+ * can't be evicted: kernel pages, frames shared copy-on-write and
+ * frames already on their way out. A frame whose reference bit is
+ * set gets a second chance and has the bit cleared. vm_fault sets
+ * the bit whenever it loads a translation for the frame.
+ *
+ * Writes are tracked through TLBLO_DIRTY: pages are mapped read-only
+ * until the first write faults, and vm_fault then sets PTE_DIRTY. A
+ * dirty victim is written to swap, to the slot it came from if it
+ * has one. A clean victim is not written at all. If it has a slot,
+ * that still holds its contents. If it has none, it still holds what
+ * as_fill_page put there, and the next fault fills it again.
+ *
+ * Eviction sleeps for disk I/O, so it is only tried when we hold no
+ * spinlocks. evict_lock allows one eviction at a time. While a page is
+ * being written out its entry is marked PTE_EVICTING, and faults on
+ * it wait on evict_lock.
+ */
+static
+bool
+vm_can_evict(void)
+{
+	return evict_lock != NULL && curthread != NULL &&
+		!curthread->t_in_interrupt && curthread->t_curspl == 0 &&
+		!lock_do_i_hold(evict_lock);
+}
+
+/*
+ * Advance the clock hand to the next victim, mark it busy and return
+ * its index, or COREMAP_NOFRAME if two sweeps found nothing. Called
+ * with coremap_lock.
+ */
+static
+int32_t
+clock_pick(void)
+{
+	struct coremap_entry *e;
+	uint32_t idx, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (n = 0; n < 2 * coremap_size; n++) {
+		idx = clock_hand;
+		clock_hand = (clock_hand + 1) % coremap_size;
+		e = &coremap[idx];
+		if (!e->cme_used || !e->cme_head || e->cme_busy ||
+		    e->cme_as == NULL || e->cme_refcount != 1) {
+			continue;
+		}
+		if (frame_refbits[idx]) {
+			frame_refbits[idx] = 0;
+			continue;
+		}
+		e->cme_busy = 1;
+		return idx;
+	}
+	return COREMAP_NOFRAME;
+}
+
+/*
+ * Evict one page and return its frame, with one reference, for the
+ * caller to use. Returns 0 if nothing could be evicted.
+ */
+static
+paddr_t
+vm_evict(void)
+{
+	struct coremap_entry *e;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr, *pte;
+	unsigned slot, tries;
+	int32_t idx;
+	bool dirty, newslot;
+	struct tlb_wait tw;
+	int result;
+
+	tlb_wait_init(&tw);
+	lock_acquire(evict_lock);
+
+	for (tries = 0; tries < coremap_size; tries++) {
+		coremap_acquire();
+		idx = clock_pick();
+		if (idx == COREMAP_NOFRAME) {
+			coremap_release();
+			break;
+		}
+		e = &coremap[idx];
+		as = e->cme_as;
+		vaddr = e->cme_vaddr;
+		coremap_release();
+		paddr = coremap_base + (paddr_t)idx * PAGE_SIZE;
+
+		/*
+		 * Unmap it. As long as the frame still names AS as its
+		 * owner, AS has not let go of this page table entry,
+		 * and can't while we hold pagetable_lock.
+		 */
+		spinlock_acquire(&pagetable_lock);
+		coremap_acquire();
+		if (e->cme_as != as || e->cme_refcount != 1) {
+			e->cme_busy = 0;
+			coremap_release();
+			spinlock_release(&pagetable_lock);
+			continue;
+		}
+		slot = e->cme_swapslot;
+		coremap_release();
+		pte = as_pte(as, vaddr);
+		KASSERT(pte != NULL && (*pte & PAGE_FRAME) == paddr);
+		KASSERT((*pte & (PTE_SWAPPED | PTE_EVICTING)) == 0);
+		dirty = (*pte & PTE_DIRTY) != 0;
+		*pte |= PTE_EVICTING;
+		tlb_shootdown(as, vaddr, 1, &tw);
+		spinlock_release(&pagetable_lock);
+		/* nobody may write the frame once we start copying it */
+		tlb_shootdown_wait(&tw);
+
+		result = 0;
+		newslot = false;
+		if (dirty) {
+			if (!swap_enabled()) {
+				result = ENOSPC;
+			}
+			else if (slot == SWAP_NOSLOT) {
+				result = swap_alloc(&slot);
+				newslot = result == 0;
+			}
+			if (result == 0) {
+				result = swap_write(slot, paddr);
+			}
+			if (result == 0) {
+				vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+			}
+		}
+
+		spinlock_acquire(&pagetable_lock);
+		coremap_acquire();
+		if (e->cme_as != as) {
+			/* The owner let go meanwhile; the frame is free. */
+			KASSERT(e->cme_refcount == 0);
+			if (e->cme_swapslot != SWAP_NOSLOT) {
+				swap_free(e->cme_swapslot);
+			}
+			if (newslot) {
+				swap_free(slot);
+			}
+		}
+		else if (result) {
+			/* Couldn't write it out: leave it be. */
+			pte = as_pte(as, vaddr);
+			*pte &= ~PTE_EVICTING;
+			if (newslot) {
+				swap_free(slot);
+			}
+			e->cme_busy = 0;
+			coremap_release();
+			spinlock_release(&pagetable_lock);
+			continue;
+		}
+		else {
+			pte = as_pte(as, vaddr);
+			if (slot != SWAP_NOSLOT) {
+				*pte = PTE_MKSWAP(slot) | (*pte & PTE_RDONLY);
+			}
+			else {
+				*pte = 0;
+			}
+		}
+		e->cme_as = NULL;
+		e->cme_swapslot = SWAP_NOSLOT;
+		e->cme_stable = 0;
+		e->cme_merged = 0;
+		textcache_remove(e);
+		frame_refbits[e - coremap] = 0;
+		e->cme_refcount = 1;
+		e->cme_busy = 0;
+		vm_nevictions++;
+		coremap_release();
+		spinlock_release(&pagetable_lock);
+
+		lock_release(evict_lock);
+		return paddr;
+	}
+
+	lock_release(evict_lock);
+	return 0;
+}
+
+/*
+ * Same-page merging.
+ *
+ * After fork, and in programs that run many copies of themselves,
+ * many private pages end up with the same contents - most often all
+ * zeros. A kernel thread (vm_merge_thread) walks the coremap a batch
+ * of frames at a time and merges frames with identical contents into
+ * one frame shared copy-on-write, exactly as fork shares them, so the
+ * first write to a merged page gets a private copy back through
+ * as_cow_break.
+ *
+ * A candidate is a frame holding one private page of one address
+ * space: owned, one reference, not shared with a file, not in the
+ * text cache and with no copy in swap. Before its contents can be
+ * compared it is made copy-on-write and shot down from the TLBs, and
+ * marked cme_stable. As long as a frame is stable nobody can change
+ * it: writes fault, and as_cow_break copies it, or, once nobody else
+ * shares it, hands it back (frame_setowner clears cme_stable).
+ *
+ * Stable frames are remembered by the hash of their contents in
+ * merge_table. The table only holds hints: a frame in it may have
+ * been written, freed or reused since, so before merging, both frames
+ * are checked again, and their contents compared, with the page table
+ * and coremap locked. Merging holds evict_lock, so the clock never
+ * sees a page half moved.
+ */
+#define MERGE_SLOTS 1024	/* entries in merge_table */
+#define MERGE_PROBE 8		/* how far to look for a hash */
+
+struct merge_slot {
+	uint32_t ms_hash;
+	paddr_t ms_paddr;	/* 0 if empty */
+};
+
+static struct merge_slot *merge_table;
+static uint32_t merge_hand = 0;		/* next frame to look at */
+
+static
+uint32_t
+merge_hash(paddr_t paddr)
+{
+	const uint32_t *w = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+	uint32_t h;
+	unsigned i;
+
+	/* FNV-1a over words */
+	h = 2166136261U;
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ w[i]) * 16777619U;
+	}
+	return h;
+}
+
+/* There is no memcmp in the kernel's libc */
+static
+bool
+merge_same(paddr_t a, paddr_t b)
+{
+	const uint32_t *wa = (const uint32_t *)PADDR_TO_KVADDR(a);
+	const uint32_t *wb = (const uint32_t *)PADDR_TO_KVADDR(b);
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (wa[i] != wb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * True if frame E may be merged away: see above. Called with
+ * pagetable_lock and coremap_lock.
+ */
+static
+bool
+merge_candidate(struct coremap_entry *e)
+{
+	paddr_t *pte;
+
+	if (!e->cme_used || !e->cme_head || e->cme_npages != 1 ||
+	    e->cme_busy || e->cme_as == NULL || e->cme_refcount != 1 ||
+	    e->cme_vnode != NULL || e->cme_swapslot != SWAP_NOSLOT) {
+		return false;
+	}
+	pte = as_pte(e->cme_as, e->cme_vaddr);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PAGE_FRAME) ==
+		coremap_base + (paddr_t)(e - coremap) * PAGE_SIZE);
+	return (*pte & (PTE_SHARED | PTE_RDONLY | PTE_EVICTING)) == 0;
+}
+
+/*
+ * Merge frame B, a stable candidate, into frame A if A is still
+ * stable and holds the same contents. Returns 0 if merged, EAGAIN if
+ * A can no longer be used at all, and EEXIST if A is fine but
+ * different. Called with evict_lock.
+ */
+static
+int
+merge_into(paddr_t a, paddr_t b)
+{
+	struct coremap_entry *ea, *eb;
+	struct addrspace *as;
+	struct tlb_wait tw;
+	paddr_t *pte;
+	int result;
+
+	KASSERT(lock_do_i_hold(evict_lock));
+
+	tlb_wait_init(&tw);
+	result = EAGAIN;
+
+	spinlock_acquire(&pagetable_lock);
+	coremap_acquire();
+	ea = &coremap[(a - coremap_base) / PAGE_SIZE];
+	eb = &coremap[(b - coremap_base) / PAGE_SIZE];
+	if (!merge_candidate(eb) || !eb->cme_stable) {
+		/* B was written or went away; nothing to do */
+		result = 0;
+		goto out;
+	}
+	if (a == b || !ea->cme_used || !ea->cme_head ||
+	    ea->cme_npages != 1 || ea->cme_busy || !ea->cme_stable) {
+		goto out;
+	}
+	if (!merge_same(a, b)) {
+		result = EEXIST;
+		goto out;
+	}
+
+	as = eb->cme_as;
+	pte = as_pte(as, eb->cme_vaddr);
+	KASSERT(*pte & PTE_COW);
+	*pte = a | (*pte & ~PAGE_FRAME);
+	tlb_shootdown(as, eb->cme_vaddr, 1, &tw);
+	ea->cme_refcount++;
+	ea->cme_merged = 1;
+	eb->cme_as = NULL;
+	eb->cme_stable = 0;
+	coremap_release();
+	spinlock_release(&pagetable_lock);
+
+	/* nobody may still be reading B through the TLB */
+	tlb_shootdown_wait(&tw);
+	frame_decref(NULL, b);
+	vmstats_inc(VMSTAT_MERGE);
+	return 0;
+
+ out:
+	coremap_release();
+	spinlock_release(&pagetable_lock);
+	return result;
+}
+
+/*
+ * Look at frame IDX: if it is a candidate, make it stable and then
+ * merge it with a frame with the same contents, or remember it.
+ */
+static
+void
+merge_frame(uint32_t idx)
+{
+	struct coremap_entry *e;
+	struct merge_slot *ms;
+	struct tlb_wait tw;
+	paddr_t paddr, *pte;
+	uint32_t hash;
+	unsigned i, victim;
+	int result;
+
+	tlb_wait_init(&tw);
+	e = &coremap[idx];
+	paddr = coremap_base + (paddr_t)idx * PAGE_SIZE;
+
+	lock_acquire(evict_lock);
+	spinlock_acquire(&pagetable_lock);
+	coremap_acquire();
+	if (!merge_candidate(e)) {
+		coremap_release();
+		spinlock_release(&pagetable_lock);
+		lock_release(evict_lock);
+		return;
+	}
+	if (!e->cme_stable) {
+		pte = as_pte(e->cme_as, e->cme_vaddr);
+		*pte |= PTE_COW;
+		e->cme_stable = 1;
+		tlb_shootdown(e->cme_as, e->cme_vaddr, 1, &tw);
+	}
+	coremap_release();
+	spinlock_release(&pagetable_lock);
+	tlb_shootdown_wait(&tw);
+
+	/* if a write unprotects it meanwhile, merge_into will notice */
+	hash = merge_hash(paddr);
+	victim = hash % MERGE_SLOTS;	/* if nothing better turns up */
+	for (i = 0; i < MERGE_PROBE; i++) {
+		ms = &merge_table[(hash + i) % MERGE_SLOTS];
+		if (ms->ms_paddr == 0 || ms->ms_paddr == paddr) {
+			victim = ms - merge_table;
+			break;
+		}
+		if (ms->ms_hash != hash) {
+			continue;
+		}
+		result = merge_into(ms->ms_paddr, paddr);
+		if (result == 0) {
+			lock_release(evict_lock);
+			return;
+		}
+		if (result == EAGAIN) {
+			/* stale: take its place */
+			victim = ms - merge_table;
+			break;
+		}
+	}
+	merge_table[victim].ms_hash = hash;
+	merge_table[victim].ms_paddr = paddr;
+	lock_release(evict_lock);
+}
+
+/*
+ * Every MERGE_INTERVAL seconds, look at the next MERGE_BATCH frames.
+ */
+static
+void
+vm_merge_thread(void *unused1, unsigned long unused2)
+{
+	unsigned n;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(MERGE_INTERVAL);
+		for (n = 0; n < MERGE_BATCH; n++) {
+			merge_frame(merge_hand);
+			merge_hand = (merge_hand + 1) % coremap_size;
+		}
+	}
+}
+
+void
+vm_merge_bootstrap(void)
+{
+	int result;
+
+	merge_table = kmalloc(MERGE_SLOTS * sizeof(struct merge_slot));
+	if (merge_table == NULL) {
+		kprintf("vm: out of memory for page merging; not merging\n");
+		return;
+	}
+	bzero(merge_table, MERGE_SLOTS * sizeof(struct merge_slot));
+
+	result = thread_fork("vm merge", NULL, vm_merge_thread, NULL, 0);
+	if (result) {
+		kprintf("vm: cannot start page merging: %s\n",
+			strerror(result));
+		kfree(merge_table);
+		merge_table = NULL;
+	}
+}
+
+/*
+ * The TLBLO bits for page table entry PTE. The page is only writable
+ * through the TLB once it is dirty, so the first write faults and
+ * marks it; never if it is copy-on-write or read-only.
+ */
+static
+uint32_t
+pte_tlblo(paddr_t pte)
+{
+	uint32_t elo;
+
+	elo = (pte & PAGE_FRAME) | TLBLO_VALID;
+	if ((pte & PTE_DIRTY) && !(pte & (PTE_COW | PTE_RDONLY))) {
+		elo |= TLBLO_DIRTY;
+	}
+	return elo;
+}
+
+/*
+ * Put the frame at PADDR, just filled by as_fill_page, into the empty
+ * page table entry PTE for page VADDR of region RG. Called with
+ * pagetable_lock.
+ */
+static
+void
+as_install_page(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		paddr_t *pte, paddr_t paddr)
+{
+	KASSERT(spinlock_do_i_hold(&pagetable_lock));
+	KASSERT(*pte == 0);
+
+	*pte = paddr;
+	if (!rg->rg_writeable) {
+		*pte |= PTE_RDONLY;
+	}
+	if (rg->rg_shared) {
+		/*
+		 * Shared pages are never paged out (see struct
+		 * shm_object), so they get no owner and the clock
+		 * leaves them alone.
+		 */
+		*pte |= PTE_SHARED;
+	}
+	else {
+		frame_setowner(paddr, as, vaddr, SWAP_NOSLOT);
+	}
+}
+
+/*
+ * Fault-around.
+ *
+ * A program scanning through memory takes a fault on every page it
+ * hasn't touched yet, and a refill on every page that fell out of the
+ * TLB. When faults in an address space arrive in sequence, vm_fault
+ * also maps up to vm_faultaround pages past the one that faulted:
+ * resident pages just get a TLB entry, and pages not touched yet are
+ * filled in as if they had faulted. It stops at the end of the region
+ * and at pages that are in swap or being evicted, and does not fill
+ * pages when memory is short. as_nextfault remembers where the next
+ * fault lands if the scan goes on, so random access doesn't trigger
+ * it.
+ *
+ * Entries are loaded as a fault would load them, so the first write
+ * to a clean page still faults and marks it dirty.
+ */
+static
+bool
+as_map_ahead(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	paddr_t *pte, paddr;
+	bool filled;
+
+	filled = false;
+	spinlock_acquire(&pagetable_lock);
+	pte = as_pte(as, vaddr);
+	if (pte == NULL || *pte == 0) {
+		spinlock_release(&pagetable_lock);
+		if (vm_memory_low() || as_pte_alloc(as, vaddr) ||
+		    as_fill_page(as, rg, vaddr, true, &paddr)) {
+			return false;
+		}
+		spinlock_acquire(&pagetable_lock);
+		pte = as_pte(as, vaddr);
+		if (*pte != 0) {
+			spinlock_release(&pagetable_lock);
+			frame_decref(NULL, paddr);
+			return false;
+		}
+		as_install_page(as, rg, vaddr, pte, paddr);
+		filled = true;
+	}
+	else if (*pte & (PTE_SWAPPED | PTE_EVICTING)) {
+		spinlock_release(&pagetable_lock);
+		return false;
+	}
+
+	frame_refbits[((*pte & PAGE_FRAME) - coremap_base) / PAGE_SIZE] = 1;
+	tlb_load(vaddr, pte_tlblo(*pte), false);
+	spinlock_release(&pagetable_lock);
+
+	vmstats_inc(filled ? VMSTAT_FAULTAROUND_FILL : VMSTAT_FAULTAROUND_MAP);
+	return true;
+}
+
+/*
+ * Called after a fault at VADDR, which is in region RG if that isn't
+ * NULL, has been handled.
+ */
+static
 void
-vm_bootstrap(void)
+as_fault_around(struct addrspace *as, struct region *rg, vaddr_t vaddr)
 {
-#if OPT_A3
-	ram_getsize(&coremap_start, &coremap_end);
-	coremap_size = (coremap_end - coremap_start) / PAGE_SIZE;
-	//kprintf("%p", (void *)coremap_start);
-	//kprintf("%p", (void *)coremap_end);
-	for (unsigned int i; i < coremap_size; i++) {
-		((int *) PADDR_TO_KVADDR(coremap_start))[i] = 0;
+	unsigned window, n;
+	vaddr_t next, end;
+
+	window = vm_faultaround;
+	next = vaddr + PAGE_SIZE;
+	if (window == 0 || vaddr != as->as_nextfault) {
+		as->as_nextfault = next;
+		return;
 	}
-	coremap_created = true;
-	/* Do nothing. */
-#endif
+
+	if (rg == NULL) {
+		rg = as_find_region(as, vaddr);
+	}
+	if (rg != NULL) {
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		for (n = 0; n < window && next < end; n++) {
+			if (!as_map_ahead(as, rg, next)) {
+				break;
+			}
+			next += PAGE_SIZE;
+		}
+	}
+	as->as_nextfault = next;
 }
 
-#if OPT_A3
-paddr_t 
-coremap_stealmem(unsigned long npages) 
+unsigned
+vm_faultaround_get(void)
 {
-  // looking for a valid start for memory allocation
-  for (unsigned int cur_index = 0; cur_index < coremap_size; cur_index++) {
-  	int cur_entry = ((int *) PADDR_TO_KVADDR(coremap_start))[cur_index];
-  	unsigned int page_start = cur_index;
-  	unsigned long page_count = 0;
-  
-	// looking for "npages" consecutive entries of "0" in coremap
-  	while (cur_entry == 0 && page_start + page_count < coremap_size) {
-		page_count += 1;
-		if (page_count == npages) {
-			//kprintf("%s", "Allocing memory: \n");
-	       		unsigned int frames = page_start;
-			unsigned long i = 1;
-			while (i <= npages) {
-				//kprintf("%p", (void *) &((int *) PADDR_TO_KVADDR(coremap_start))[frames]);
-				//kprintf("%s", "\n");
-				((int *) PADDR_TO_KVADDR(coremap_start))[frames] = (int) i;
-				i += 1;
-				frames += 1;
-			}
-			//paddr_t frame_start = coremap_start + sizeof(int *) * coremap_size;
-			//return frame_start + page_start * PAGE_SIZE;
-			return (page_start + 1) * PAGE_SIZE + coremap_start;
-		} else {
-			cur_index += 1;
-			cur_entry = ((int *) PADDR_TO_KVADDR(coremap_start))[cur_index];
-		}
-    	}
-	// cur_entry != 0; need a new page_start
-  }
-  return 0;
+	return vm_faultaround;
 }
-#endif
 
-static
-paddr_t
-getppages(unsigned long npages)
+void
+vm_faultaround_set(unsigned npages)
 {
-	paddr_t addr;
-#if OPT_A3
-	if (coremap_created) {
-		spinlock_acquire(&coremap_lock);
-		
-		addr = coremap_stealmem(npages);
+	vm_faultaround = npages < FAULTAROUND_MAX ? npages : FAULTAROUND_MAX;
+}
 
-		spinlock_release(&coremap_lock);
-	} else {
-		spinlock_acquire(&stealmem_lock);
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	paddr_t *pte, paddr, oldpte, newpa;
+	struct tlb_wait tw;
+	time_t secs;
+	uint32_t elo, nsecs;
+	int result;
 
-        	addr = ram_stealmem(npages);
+	faultaddress &= PAGE_FRAME;
+	tlb_wait_init(&tw);
 
-        	spinlock_release(&stealmem_lock);
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
 	}
-#else
-	spinlock_acquire(&stealmem_lock);
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-#endif
-	return addr;
-}
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
-{
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
 	}
-	return PADDR_TO_KVADDR(pa);
-}
+	rg = NULL;
 
-void 
-free_kpages(vaddr_t addr)
-{
-#if OPT_A3
-	spinlock_acquire(&coremap_lock);
-	paddr_t p_addr = KVADDR_TO_PADDR(addr);
-	//paddr_t frame_start = coremap_start + sizeof(int *) * coremap_size;
-	//unsigned int cur_index = (p_addr - frame_start) / PAGE_SIZE;
-	unsigned int cur_index = ((p_addr - coremap_start) / PAGE_SIZE) - 1;
-	int cur_entry = ((int *) PADDR_TO_KVADDR(coremap_start))[cur_index];
-	int previous_entry = cur_entry;
-
-	((int *) PADDR_TO_KVADDR(coremap_start))[cur_index] = 0;
-	cur_index++;
-	cur_entry = ((int *) PADDR_TO_KVADDR(coremap_start))[cur_index];
-	while (cur_entry == previous_entry + 1) {
-		previous_entry = cur_entry;
-		((int *) PADDR_TO_KVADDR(coremap_start))[cur_index] = 0;
-        	cur_index++;
-        	cur_entry = ((int *) PADDR_TO_KVADDR(coremap_start))[cur_index];
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_regions != NULL);
+	KASSERT(as->as_pagetable != NULL);
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
 	}
-	spinlock_release(&coremap_lock);
-#else
-	/* nothing - leak the memory. */
 
-	(void)addr;
-#endif
-}
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+	gettime(&secs, &nsecs);
 
-void
-vm_tlbshootdown_all(void)
-{
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	/* frame for a copy-on-write copy, allocated on a first pass */
+	newpa = 0;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+ again:
+	spinlock_acquire(&pagetable_lock);
+
+	pte = as_pte(as, faultaddress);
+	if (pte != NULL && (*pte & PTE_EVICTING)) {
+		/* wait for it to finish going out, then bring it back */
+		spinlock_release(&pagetable_lock);
+		lock_acquire(evict_lock);
+		lock_release(evict_lock);
+		goto again;
+	}
+
+	if (pte == NULL || *pte == 0) {
+		/*
+		 * First touch: only now do we need the region. Page it
+		 * in without holding the spinlock.
+		 */
+		spinlock_release(&pagetable_lock);
+		rg = as_find_region(as, faultaddress);
+		if (rg == NULL) {
+			rg = as_grow_stack(as, faultaddress);
+		}
+		if (rg == NULL) {
+			result = EFAULT;
+			goto fail;
+		}
+		if (faulttype != VM_FAULT_READ && !rg->rg_writeable) {
+			result = EFAULT;
+			goto fail;
+		}
+		result = as_pte_alloc(as, faultaddress);
+		if (result) {
+			goto fail;
+		}
+		result = as_fill_page(as, rg, faultaddress, false, &paddr);
+		if (result) {
+			goto fail;
+		}
+
+		spinlock_acquire(&pagetable_lock);
+		pte = as_pte(as, faultaddress);
+		KASSERT(pte != NULL);
+		if (*pte != 0) {
+			spinlock_release(&pagetable_lock);
+			frame_decref(NULL, paddr);
+			goto again;
+		}
+		as_install_page(as, rg, faultaddress, pte, paddr);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		oldpte = *pte;
+		spinlock_release(&pagetable_lock);
+
+		paddr = getppages(1);
+		if (paddr == 0) {
+			result = ENOMEM;
+			goto fail;
+		}
+		result = swap_read(PTE_SWAPSLOT(oldpte), paddr);
+		if (result) {
+			frame_decref(NULL, paddr);
+			goto fail;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+
+		spinlock_acquire(&pagetable_lock);
+		pte = as_pte(as, faultaddress);
+		if (*pte != oldpte) {
+			spinlock_release(&pagetable_lock);
+			frame_decref(NULL, paddr);
+			goto again;
+		}
+		/* the slot stays with the frame until it is dirtied */
+		*pte = paddr | (oldpte & PTE_RDONLY);
+		frame_setowner(paddr, as, faultaddress, PTE_SWAPSLOT(oldpte));
+	}
+	else if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
 
+	if (faulttype != VM_FAULT_READ) {
+		if (*pte & PTE_RDONLY) {
+			spinlock_release(&pagetable_lock);
+			result = EFAULT;
+			goto fail;
+		}
+		if (*pte & PTE_COW) {
+			if (newpa == 0 &&
+			    frame_refcount(*pte & PAGE_FRAME) > 1) {
+				/* get a frame to copy into, and look again */
+				spinlock_release(&pagetable_lock);
+				newpa = getppages(1);
+				if (newpa == 0) {
+					result = ENOMEM;
+					goto fail;
+				}
+				goto again;
+			}
+			as_cow_break(as, faultaddress, pte, &newpa);
+			/* other cpus may still map the shared frame */
+			tlb_shootdown(as, faultaddress, 1, &tw);
+		}
+		*pte |= PTE_DIRTY;
+	}
+
+	paddr = *pte & PAGE_FRAME;
+	elo = pte_tlblo(*pte);
+	frame_refbits[(paddr - coremap_base) / PAGE_SIZE] = 1;
+
+	/*
+	 * Load the TLB before letting go of the page table, so an
+	 * eviction of this page can't miss the new entry.
+	 */
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_load(faultaddress, elo, faulttype != VM_FAULT_READONLY);
+	spinlock_release(&pagetable_lock);
+
+	/*
+	 * Finish any copy-on-write shootdown before fault-around, which
+	 * can sleep (and then migrate us to a cpu we are waiting on).
+	 */
+	tlb_shootdown_wait(&tw);
+
+	if (faulttype != VM_FAULT_READONLY) {
+		as_fault_around(as, rg, faultaddress);
+	}
+
+	result = 0;
+	goto done;
+
+ fail:
+	tlb_shootdown_wait(&tw);
+ done:
+	if (newpa != 0) {
+		frame_decref(NULL, newpa);
+	}
+	vmstats_hist_since(VMHIST_FAULT, secs, nsecs);
+	return result;
+}
+#else
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -213,12 +2806,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-#if OPT_A3
-		return EFAULT;
-#else
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
-#endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -253,10 +2842,10 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT(as->as_npages2 != 0);
 	KASSERT(as->as_stackpbase != 0);
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	//KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
+	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	//KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	//KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
+	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
 
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -265,24 +2854,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-#if OPT_A3
-	bool text_seg = false;
-	bool loadelf_completed = as->loadelf_completed;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1[0];
-    		text_seg = true;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2[0];
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase[0];
-	}
-	else {
-		return EFAULT;
-	}
-#else
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 	}
@@ -295,7 +2866,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else {
 		return EFAULT;
 	}
-#endif
+
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
@@ -309,31 +2880,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		}
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-#if OPT_A3
-		if (text_seg && loadelf_completed) {
-			elo &= ~TLBLO_DIRTY;
-		}
-#endif
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
-#if OPT_A3
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (text_seg && loadelf_completed) {
-        	elo &= ~TLBLO_DIRTY;
-        }
-	tlb_random(ehi, elo);
-	splx(spl);
-	return 0;
-#else
+
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
-#endif
 }
+#endif
 
 struct addrspace *
 as_create(void)
@@ -344,14 +2901,25 @@ as_create(void)
 	}
 	
 #if OPT_A3
-	as->as_vbase1 = 0;
-	as->as_pbase1 = NULL;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = NULL;
-	as->as_npages2 = 0;
-	as->as_stackpbase = NULL;
-  	as->loadelf_completed = false;
+	as->as_vnode = NULL;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_nextfault = 0;
+	as->as_regions = array_create();
+	as->as_pagetable = kmalloc(PT_L1_ENTRIES * sizeof(paddr_t *));
+	as->as_asids = kmalloc(cpu_numcpus() * sizeof(uint32_t));
+	if (as->as_regions == NULL || as->as_pagetable == NULL ||
+	    as->as_asids == NULL) {
+		if (as->as_regions != NULL) {
+			array_destroy(as->as_regions);
+		}
+		kfree(as->as_pagetable);
+		kfree(as->as_asids);
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_pagetable, PT_L1_ENTRIES * sizeof(paddr_t *));
+	bzero(as->as_asids, cpu_numcpus() * sizeof(uint32_t));
 #else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
@@ -365,28 +2933,213 @@ as_create(void)
 	return as;
 }
 
+#if OPT_A3
+/*
+ * Drop AS's reference to each frame and swap slot in a second-level
+ * page table, and free the table. The frames are gathered into the
+ * front of the table itself and released in one batch; the table is
+ * dead by then, and pagetable_lock keeps the evictor and the merge
+ * scanner from looking at it until the frames have been disowned.
+ */
+static
+void
+as_release_pages(struct addrspace *as, paddr_t *l2)
+{
+	paddr_t pte;
+	unsigned i, n;
+
+	spinlock_acquire(&pagetable_lock);
+	n = 0;
+	for (i = 0; i < PT_L2_ENTRIES; i++) {
+		pte = l2[i];
+		l2[i] = 0;
+		if (pte & PTE_SWAPPED) {
+			swap_free(PTE_SWAPSLOT(pte));
+		}
+		else if (pte != 0) {
+			l2[n++] = pte & PAGE_FRAME;
+		}
+	}
+	frame_decref_batch(as, l2, n);
+	spinlock_release(&pagetable_lock);
+	kfree(l2);
+}
+
+/*
+ * Write the dirty pages of RG, a MAP_SHARED mapping of a file, back
+ * to the file. Each page is marked clean, and any TLB entry that lets
+ * it be written is shot down, before its contents are copied out, so
+ * a write that races with the copy faults and dirties it again.
+ */
+static
+int
+as_sync_region(struct addrspace *as, struct region *rg)
+{
+	struct tlb_wait tw;
+	struct iovec iov;
+	struct uio ku;
+	paddr_t *pte, paddr;
+	vaddr_t vaddr, end;
+	size_t len;
+	int result;
+
+	KASSERT(rg->rg_shared && rg->rg_vnode != NULL);
+
+	tlb_wait_init(&tw);
+	end = rg->rg_filevaddr + rg->rg_filesize;
+	for (vaddr = rg->rg_vbase; vaddr < end; vaddr += PAGE_SIZE) {
+		spinlock_acquire(&pagetable_lock);
+		pte = as_pte(as, vaddr);
+		if (pte == NULL || (*pte & PTE_DIRTY) == 0) {
+			spinlock_release(&pagetable_lock);
+			continue;
+		}
+		KASSERT(*pte & PTE_SHARED);
+		*pte &= ~PTE_DIRTY;
+		paddr = *pte & PAGE_FRAME;
+		tlb_shootdown(as, vaddr, 1, &tw);
+		spinlock_release(&pagetable_lock);
+		tlb_shootdown_wait(&tw);
+
+		/* only the thread running in AS can unmap the frame */
+		len = end - vaddr < PAGE_SIZE ? end - vaddr : PAGE_SIZE;
+		textcache_forget(rg->rg_vnode,
+			(rg->rg_fileoffset + (vaddr - rg->rg_vbase)) / PAGE_SIZE);
+		uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), len,
+			  rg->rg_fileoffset + (vaddr - rg->rg_vbase),
+			  UIO_WRITE);
+		result = VOP_WRITE(rg->rg_vnode, &ku);
+		if (result) {
+			/* leave it dirty for next time */
+			spinlock_acquire(&pagetable_lock);
+			*as_pte(as, vaddr) |= PTE_DIRTY;
+			spinlock_release(&pagetable_lock);
+			return result;
+		}
+		vmstats_inc(VMSTAT_MMAP_FILE_WRITE);
+	}
+	return 0;
+}
+#endif
+
 void
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-	//spinlock_acquire(&pagetable_lock);
-	for (unsigned int i = 0; i < as->as_npages1; i++) {
-	  paddr_t paddr = PADDR_TO_KVADDR(as->as_pbase1[i]);
-    	  free_kpages(paddr);
-  	}
-        for (unsigned int i = 0; i < as->as_npages2; i++) {
-	  paddr_t paddr = PADDR_TO_KVADDR(as->as_pbase2[i]);
-          free_kpages(paddr);
-        }
-        for (unsigned int i = 0; i < DUMBVM_STACKPAGES; i++) {
-	  paddr_t paddr = PADDR_TO_KVADDR(as->as_stackpbase[i]);
-          free_kpages(paddr);
-        }
-	//spinlock_release(&pagetable_lock);
+	struct region *rg;
+	unsigned i;
+
+	/* changes made through shared file mappings go to the file */
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_shared && rg->rg_vnode != NULL &&
+		    rg->rg_writeable) {
+			(void)as_sync_region(as, rg);
+		}
+	}
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (as->as_pagetable[i] != NULL) {
+			as_release_pages(as, as->as_pagetable[i]);
+		}
+	}
+	/* swap_free left the pool buffers of our swapped pages behind */
+	swap_reap();
+	kfree(as->as_pagetable);
+	kfree(as->as_asids);
+
+	while (array_num(as->as_regions) > 0) {
+		rg = array_get(as->as_regions, 0);
+		array_remove(as->as_regions, 0);
+		if (rg->rg_shm != NULL) {
+			shm_detach(rg->rg_shm);
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+	array_destroy(as->as_regions);
+
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 #endif
 	kfree(as);
 }
-
+
+#if OPT_A3
+/*
+ * Hand out the next ASID on cpu C, starting a new generation (and
+ * flushing the TLB) if we have run out. Called with interrupts off.
+ */
+static
+uint32_t
+asid_alloc(struct cpu *c)
+{
+	uint32_t asid;
+
+	asid = ++c->c_asid_last;
+	if ((asid & ASID_MASK) == 0) {
+		if (asid == 0) {
+			/* the generation count wrapped; skip generation 0 */
+			asid = c->c_asid_last = ASID_FIRST;
+		}
+		tlb_flush();
+		vmstats_inc(VMSTAT_ASID_ROLLOVER);
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	return asid;
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as, *lastas;
+	struct cpu *c;
+	uint32_t asid;
+	bool flushed;
+	int spl;
+
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		cpupagetables[curcpu->c_number] = 0;
+		return;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	cpupagetables[c->c_number] = (vaddr_t)as->as_pagetable;
+
+	/*
+	 * Publish c_lastas before reading our ASID: tlb_shootdown
+	 * retires the ASID and then looks at c_lastas, so one of us
+	 * sees the other.
+	 */
+	lastas = c->c_lastas;
+	c->c_lastas = as;
+	asid = as->as_asids[c->c_number];
+	flushed = false;
+	if (lastas != as || !ASID_CURRENT(c, asid)) {
+		if (!ASID_CURRENT(c, asid)) {
+			flushed = ((c->c_asid_last + 1) & ASID_MASK) == 0;
+			asid = asid_alloc(c);
+			as->as_asids[c->c_number] = asid;
+		}
+		c->c_asid = asid;
+		tlb_setasid(asid);
+	}
+
+	splx(spl);
+
+	if (!flushed) {
+		vmstats_inc(VMSTAT_TLB_FLUSH_AVOIDED);
+	}
+}
+#else
 void
 as_activate(void)
 {
@@ -410,12 +3163,91 @@ as_activate(void)
 
 	splx(spl);
 }
+#endif
 
 void
 as_deactivate(void)
 {
+#if OPT_A3
+	/* the refill fast path must not walk a table that is going away */
+	cpupagetables[curcpu->c_number] = 0;
+#else
 	/* nothing */
+#endif
+}
+
+#if OPT_A3
+/*
+ * Add a region of NPAGES pages at VADDR to the sorted region list.
+ * Regions may not overlap.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      bool writeable)
+{
+	struct region *rg, *other;
+	unsigned i, num;
+	int result;
+
+	/* pages are filled without uiomove, so check for kernel addresses */
+	if (vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+	    vaddr + npages * PAGE_SIZE < vaddr) {
+		return EFAULT;
+	}
+	if (npages == 0) {
+		return 0;
+	}
+
+	/* find the first region above VADDR */
+	num = array_num(as->as_regions);
+	for (i = 0; i < num; i++) {
+		other = array_get(as->as_regions, i);
+		if (other->rg_vbase >= vaddr) {
+			break;
+		}
+	}
+	if (i > 0) {
+		other = array_get(as->as_regions, i - 1);
+		if (other->rg_vbase + other->rg_npages * PAGE_SIZE > vaddr) {
+			return EINVAL;
+		}
+	}
+	if (i < num) {
+		other = array_get(as->as_regions, i);
+		if (vaddr + npages * PAGE_SIZE > other->rg_vbase) {
+			return EINVAL;
+		}
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_filevaddr = 0;
+	rg->rg_fileoffset = 0;
+	rg->rg_filesize = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_mapped = false;
+	rg->rg_shared = false;
+	rg->rg_shm = NULL;
+
+	result = array_setsize(as->as_regions, num + 1);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	for (; num > i; num--) {
+		array_set(as->as_regions, num,
+			  array_get(as->as_regions, num - 1));
+	}
+	array_set(as->as_regions, i, rg);
+	return 0;
 }
+#endif
 
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
@@ -432,6 +3264,13 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+#if OPT_A3
+	/* Pages are always readable; executable is not enforced. */
+	(void)readable;
+	(void)executable;
+
+	return as_add_region(as, vaddr, npages, writeable != 0);
+#else
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -439,18 +3278,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
-#if OPT_A3
-    		as->as_pbase1 = kmalloc(sizeof(paddr_t) * npages);
-#endif		
 		as->as_npages1 = npages;
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
-#if OPT_A3
-    		as->as_pbase2 = kmalloc(sizeof(paddr_t) * npages);
-#endif
 		as->as_npages2 = npages;
 		return 0;
 	}
@@ -460,6 +3293,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
+#endif
 }
 
 static
@@ -472,47 +3306,18 @@ as_zero_region(paddr_t paddr, unsigned npages)
 int
 as_prepare_load(struct addrspace *as)
 {
-	//KASSERT(as->as_pbase1 == NULL);
-	//KASSERT(as->as_pbase2 == NULL);
-	//KASSERT(as->as_stackpbase == NULL);
 #if OPT_A3
-	// Not contiguous memory segment 
-	// This is what we want for paging
-    unsigned int pages1_cur = 0;
-  	while(pages1_cur < as->as_npages1) {
-    	  paddr_t paddr = getppages(1);
-    	  if (paddr == 0) {
-		     return ENOMEM;
-	      }
-    	  as->as_pbase1[pages1_cur] = paddr;
-    	  as_zero_region(as->as_pbase1[pages1_cur], 1);
-          pages1_cur ++;
-  	}
-    unsigned int pages2_cur = 0;
-    while(pages2_cur < as->as_npages2) {
-         paddr_t paddr = getppages(1);
-         if (paddr == 0) {
-             return ENOMEM;
-         }
-         as->as_pbase2[pages2_cur] = paddr;
-         as_zero_region(as->as_pbase2[pages2_cur], 1);
-         pages2_cur ++;
-    }
-	as->as_stackpbase = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == NULL) {
-		return ENOMEM;
-	}
-    unsigned int stackpages_cur = 0;
-  	while(stackpages_cur < DUMBVM_STACKPAGES) {
-    	  paddr_t paddr = getppages(1);
-    	  if (paddr == 0) {
-		     return ENOMEM;
-	  }
-         as->as_stackpbase[stackpages_cur] = paddr;
-         as_zero_region(as->as_stackpbase[stackpages_cur], 1);
-         stackpages_cur ++;
-  	}
+	/*
+	 * No frames or page tables are allocated here. Every page
+	 * starts out empty and vm_fault fills it on first touch, from
+	 * the executable (see as_define_segment) or with zeros.
+	 */
+	(void)as;
 #else
+	KASSERT(as->as_pbase1 == 0);
+	KASSERT(as->as_pbase2 == 0);
+	KASSERT(as->as_stackpbase == 0);
+
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
@@ -539,33 +3344,532 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
+#if OPT_A3
+	struct region *rg, *last;
+	unsigned num;
+	int result;
+
+	/*
+	 * The heap starts out empty at the first page boundary above
+	 * the executable, and sbrk moves its end.
+	 */
+	KASSERT(as->as_heap == NULL);
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	num = array_num(as->as_regions);
+	if (num > 0) {
+		last = array_get(as->as_regions, num - 1);
+		rg->rg_vbase = last->rg_vbase + last->rg_npages * PAGE_SIZE;
+	}
+	else {
+		rg->rg_vbase = 0;
+	}
+	rg->rg_npages = 0;
+	rg->rg_writeable = true;
+	rg->rg_filevaddr = 0;
+	rg->rg_fileoffset = 0;
+	rg->rg_filesize = 0;
+	rg->rg_vnode = NULL;
+	rg->rg_mapped = false;
+	rg->rg_shared = false;
+	rg->rg_shm = NULL;
+
+	result = array_add(as->as_regions, rg, NULL);
+	if (result) {
+		kfree(rg);
+		return result;
+	}
+	as->as_heap = rg;
+	as->as_heapbrk = rg->rg_vbase;
+#else
 	(void)as;
+#endif
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+#if OPT_A3
+	int result;
+
+	result = as_add_region(as, USERSTACK - DUMBVM_STACKINITPAGES * PAGE_SIZE,
+			       DUMBVM_STACKINITPAGES, true);
+	if (result) {
+		return result;
+	}
+#else
 	KASSERT(as->as_stackpbase != 0);
+#endif
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+#if OPT_A3
+int
+as_define_segment(struct addrspace *as, struct vnode *v,
+		  off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct region *rg;
+
+	rg = as_find_region(as, vaddr & PAGE_FRAME);
+	if (rg == NULL) {
+		return EINVAL;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+
+	rg->rg_filevaddr = vaddr;
+	rg->rg_fileoffset = offset;
+	rg->rg_filesize = filesize;
+	return 0;
+}
+#endif
+
+#if OPT_A3
+/*
+ * Remove NPAGES pages of AS from VADDR up: forget their frames and
+ * swap slots, and shoot down their TLB entries. Frames are only
+ * released once no TLB can reach them any more, a batch at a time.
+ * Holding evict_lock keeps the clock away, so none of the pages is
+ * half way out to swap and no frame changes hands under us.
+ */
+static
+void
+as_unmap_range(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+	paddr_t frames[TLBSHOOTDOWN_MAX];
+	paddr_t *pte;
+	struct tlb_wait tw;
+	unsigned i, n, nframes;
+
+	tlb_wait_init(&tw);
+	lock_acquire(evict_lock);
+	while (npages > 0) {
+		n = npages < TLBSHOOTDOWN_MAX ? npages : TLBSHOOTDOWN_MAX;
+		nframes = 0;
+
+		spinlock_acquire(&pagetable_lock);
+		for (i = 0; i < n; i++) {
+			pte = as_pte(as, vaddr + i * PAGE_SIZE);
+			if (pte == NULL || *pte == 0) {
+				continue;
+			}
+			KASSERT((*pte & PTE_EVICTING) == 0);
+			if (*pte & PTE_SWAPPED) {
+				swap_free(PTE_SWAPSLOT(*pte));
+			}
+			else {
+				frames[nframes++] = *pte & PAGE_FRAME;
+			}
+			*pte = 0;
+		}
+		tlb_shootdown(as, vaddr, n, &tw);
+		spinlock_release(&pagetable_lock);
+		tlb_shootdown_wait(&tw);
+
+		for (i = 0; i < nframes; i++) {
+			frame_decref(as, frames[i]);
+		}
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+	lock_release(evict_lock);
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *rg, *other;
+	vaddr_t brk, limit;
+	size_t npages;
+	unsigned i;
+
+	rg = as->as_heap;
+	if (rg == NULL) {
+		return EINVAL;
+	}
+	brk = as->as_heapbrk;
+
+	if (amount < 0) {
+		if ((vaddr_t)-amount > brk - rg->rg_vbase) {
+			return EINVAL;
+		}
+	}
+	else {
+		/* leave room for the stack to grow; stop at mappings */
+		limit = USERSTACK - DUMBVM_STACKMAXPAGES * PAGE_SIZE;
+		for (i = 0; i < array_num(as->as_regions); i++) {
+			other = array_get(as->as_regions, i);
+			if (other->rg_vbase > rg->rg_vbase &&
+			    other->rg_vbase < limit) {
+				limit = other->rg_vbase;
+			}
+		}
+		if (brk + amount < brk || brk + amount > limit) {
+			return ENOMEM;
+		}
+	}
+
+	npages = DIVROUNDUP(brk + amount - rg->rg_vbase, PAGE_SIZE);
+	if (npages < rg->rg_npages) {
+		as_unmap_range(as, rg->rg_vbase + npages * PAGE_SIZE,
+			       rg->rg_npages - npages);
+	}
+	rg->rg_npages = npages;
+	as->as_heapbrk = brk + amount;
+
+	*oldbrk = brk;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES of mappings. Mappings are placed top down,
+ * starting below the space the stack may grow into, so the heap has
+ * as much room as possible to grow up. A page is kept free above the
+ * heap even when it is empty, so no two regions start at the same
+ * address.
+ */
+static
+int
+as_find_gap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t top, end, size;
+	unsigned i;
+
+	size = npages * PAGE_SIZE;
+	top = USERSTACK - DUMBVM_STACKMAXPAGES * PAGE_SIZE;
+	for (i = array_num(as->as_regions); i-- > 0; ) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_vbase >= top) {
+			/* the stack */
+			continue;
+		}
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg == as->as_heap) {
+			end += PAGE_SIZE;
+		}
+		if (end <= top && top - end >= size) {
+			*ret = top - size;
+			return 0;
+		}
+		top = rg->rg_vbase;
+	}
+	/* don't map page 0 */
+	if (top > size) {
+		*ret = top - size;
+		return 0;
+	}
+	return ENOMEM;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *vn, off_t offset, size_t len,
+	int prot, int flags, vaddr_t *ret)
+{
+	struct region *rg;
+	struct shm_object *so;
+	struct stat st;
+	vaddr_t vaddr;
+	size_t npages;
+	off_t filesize, shmpages;
+	int result;
+
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	/* the part of the mapping that has file data behind it */
+	filesize = 0;
+	if (vn != NULL) {
+		result = VOP_MMAP(vn);
+		if (result) {
+			return result;
+		}
+		result = VOP_STAT(vn, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size > offset) {
+			filesize = st.st_size - offset;
+		}
+		if (filesize > (off_t)len) {
+			filesize = len;
+		}
+	}
+
+	result = as_find_gap(as, npages, &vaddr);
+	if (result) {
+		return result;
+	}
+	so = NULL;
+	if ((flags & MAP_TYPE) == MAP_SHARED) {
+		/* a file's object is indexed from the start of the file */
+		shmpages = npages;
+		if (vn != NULL) {
+			shmpages += offset / PAGE_SIZE;
+		}
+		if (shmpages > vm_shared_limit) {
+			return ENOMEM;
+		}
+		result = shm_attach(vn, shmpages, &so);
+		if (result) {
+			return result;
+		}
+	}
+	result = as_add_region(as, vaddr, npages, (prot & PROT_WRITE) != 0);
+	if (result) {
+		if (so != NULL) {
+			shm_detach(so);
+		}
+		return result;
+	}
+	rg = as_find_region(as, vaddr);
+	KASSERT(rg != NULL && rg->rg_vbase == vaddr);
+
+	rg->rg_mapped = true;
+	rg->rg_shared = so != NULL;
+	rg->rg_shm = so;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+		rg->rg_vnode = vn;
+		rg->rg_filevaddr = vaddr;
+		rg->rg_fileoffset = offset;
+		rg->rg_filesize = filesize;
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+/*
+ * Only whole mappings can be unmapped.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	unsigned i;
+	int result;
+
+	if (vaddr >= USERSPACETOP) {
+		return EINVAL;
+	}
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL || !rg->rg_mapped || rg->rg_vbase != vaddr ||
+	    DIVROUNDUP(len, PAGE_SIZE) != rg->rg_npages) {
+		return EINVAL;
+	}
+
+	if (rg->rg_shared && rg->rg_vnode != NULL && rg->rg_writeable) {
+		result = as_sync_region(as, rg);
+		if (result) {
+			return result;
+		}
+	}
+	as_unmap_range(as, rg->rg_vbase, rg->rg_npages);
+
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		if (array_get(as->as_regions, i) == rg) {
+			array_remove(as->as_regions, i);
+			break;
+		}
+	}
+	if (rg->rg_shm != NULL) {
+		shm_detach(rg->rg_shm);
+	}
+	if (rg->rg_vnode != NULL) {
+		VOP_DECREF(rg->rg_vnode);
+	}
+	kfree(rg);
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, struct vnode *vn)
+{
+	struct region *rg;
+	unsigned i;
+	int result;
+
+	if (as == NULL) {
+		return 0;
+	}
+	for (i = 0; i < array_num(as->as_regions); i++) {
+		rg = array_get(as->as_regions, i);
+		if (rg->rg_vnode == vn && rg->rg_shared && rg->rg_writeable) {
+			result = as_sync_region(as, rg);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Share every frame of an old second-level page table with a new
+ * one, copy-on-write. Pages that are out in swap are skipped. Both
+ * entries lose write permission; the first write through either one
+ * faults and gets a private copy (as_cow_break). Pages of MAP_SHARED
+ * mappings stay writable and shared; pages of them not touched yet are
+ * found through the region's shm_object later. Called with
+ * pagetable_lock and coremap_lock held.
+ */
+static
+void
+as_share_pages(paddr_t *oldptes, paddr_t *newptes)
+{
+	unsigned i;
+
+	for (i = 0; i < PT_L2_ENTRIES; i++) {
+		if (oldptes[i] == 0 || (oldptes[i] & PTE_SWAPPED)) {
+			continue;
+		}
+		KASSERT((oldptes[i] & PTE_EVICTING) == 0);
+		if ((oldptes[i] & PTE_SHARED) == 0) {
+			oldptes[i] |= PTE_COW;
+		}
+		newptes[i] = oldptes[i];
+		frame_entry(oldptes[i] & PAGE_FRAME)->cme_refcount++;
+	}
+}
+#endif
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 #if OPT_A3
-	// Acquire lock when copying from the old address space 
+	struct addrspace *new;
+	struct region *rg;
+	paddr_t *l2, pte;
+	unsigned i, j, slot;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < array_num(old->as_regions); i++) {
+		rg = kmalloc(sizeof(struct region));
+		if (rg == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		*rg = *(struct region *)array_get(old->as_regions, i);
+		result = array_add(new->as_regions, rg, NULL);
+		if (result) {
+			kfree(rg);
+			as_destroy(new);
+			return result;
+		}
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+		}
+		if (rg->rg_shm != NULL) {
+			shm_incref(rg->rg_shm);
+		}
+		if (array_get(old->as_regions, i) == old->as_heap) {
+			new->as_heap = rg;
+		}
+	}
+	new->as_heapbrk = old->as_heapbrk;
+	new->as_nextfault = 0;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+
+	/* Only the parent's thread changes its first-level table. */
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (old->as_pagetable[i] == NULL) {
+			continue;
+		}
+		l2 = kmalloc(PT_L2_ENTRIES * sizeof(paddr_t));
+		if (l2 == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		bzero(l2, PT_L2_ENTRIES * sizeof(paddr_t));
+		new->as_pagetable[i] = l2;
+	}
+
+	/*
+	 * No frames are copied here: parent and child share them all
+	 * copy-on-write, so fork costs one pass over the page tables.
+	 * Holding evict_lock means none of the parent's pages is half
+	 * way out to swap; once shared, they can't be evicted.
+	 */
+	lock_acquire(evict_lock);
 	spinlock_acquire(&pagetable_lock);
-#endif	
+	coremap_acquire();
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (old->as_pagetable[i] != NULL) {
+			as_share_pages(old->as_pagetable[i],
+				       new->as_pagetable[i]);
+		}
+	}
+	coremap_release();
+	spinlock_release(&pagetable_lock);
+	lock_release(evict_lock);
+
+	/*
+	 * Pages that are out in swap get a slot of their own. The
+	 * parent's swapped entries can't change under us: only its
+	 * own faults bring them back in.
+	 */
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (old->as_pagetable[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			pte = old->as_pagetable[i][j];
+			if (!(pte & PTE_SWAPPED)) {
+				continue;
+			}
+			result = swap_dup(PTE_SWAPSLOT(pte), &slot);
+			if (result) {
+				as_destroy(new);
+				return result;
+			}
+			new->as_pagetable[i][j] =
+				PTE_MKSWAP(slot) | (pte & PTE_RDONLY);
+		}
+	}
+
+	/*
+	 * The parent's TLB entries may still allow writes. Rather than
+	 * hunt them down, retire every ASID it has: the entries can
+	 * never match again, and it gets a fresh ASID on its next
+	 * activation.
+	 */
+	for (i = 0; i < cpu_numcpus(); i++) {
+		old->as_asids[i] = 0;
+	}
+	if (old == curproc_getas()) {
+		as_activate();
+	}
+
+	*ret = new;
+	return 0;
+#else
 	struct addrspace *new;
 
 	new = as_create();
 	if (new==NULL) {
-#if OPT_A3
-		spinlock_release(&pagetable_lock);
-#endif
 		return ENOMEM;
 	}
 
@@ -574,19 +3878,9 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
-// Allocate frames for the segments
-#if OPT_A3
-  new->as_pbase1 = kmalloc(sizeof(paddr_t) * old->as_npages1);
-  new->as_pbase2 = kmalloc(sizeof(paddr_t) * old->as_npages2);
-  new->as_stackpbase = kmalloc(sizeof(paddr_t) * DUMBVM_STACKPAGES);
-#endif
-
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
-#if OPT_A3
-		spinlock_release(&pagetable_lock);
-#endif
 		return ENOMEM;
 	}
 
@@ -594,25 +3888,6 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
 
-// Copying from the old address space to the frames
-#if OPT_A3
-  unsigned int pages1_cur = 0;
-  while (pages1_cur < old->as_npages1) {
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1[pages1_cur]), (const void *)PADDR_TO_KVADDR(old->as_pbase1[pages1_cur]),PAGE_SIZE);
-        pages1_cur ++;
-  }
-  unsigned int pages2_cur = 0;
-  while (pages2_cur < old->as_npages2) {
-   	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2[pages2_cur]), (const void *)PADDR_TO_KVADDR(old->as_pbase2[pages2_cur]),PAGE_SIZE);
-        pages2_cur ++;
-  }
-  unsigned int stackpages_cur = 0;
-  while (stackpages_cur < DUMBVM_STACKPAGES) {
-    	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase[stackpages_cur]), (const void *)PADDR_TO_KVADDR(old->as_stackpbase[stackpages_cur]),PAGE_SIZE);
-        stackpages_cur ++;
-  }
-#else
-
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
@@ -624,11 +3899,8 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
-#endif	
+	
 	*ret = new;
-#if OPT_A3
-	spinlock_release(&pagetable_lock);
-#endif	
 	return 0;
+#endif
 }
-
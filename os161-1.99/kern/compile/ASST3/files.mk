@@ -88,8 +88,10 @@ SRCS+=$(KTOP)/syscall/loadelf.c
 SRCS+=$(KTOP)/syscall/proc_syscalls.c
 SRCS+=$(KTOP)/syscall/runprogram.c
 SRCS+=$(KTOP)/syscall/time_syscalls.c
+SRCS+=$(KTOP)/syscall/vm_syscalls.c
 SRCS+=$(KTOP)/test/arraytest.c
 SRCS+=$(KTOP)/test/bitmaptest.c
+SRCS+=$(KTOP)/test/coremaptest.c
 SRCS+=$(KTOP)/test/fstest.c
 SRCS+=$(KTOP)/test/malloctest.c
 SRCS+=$(KTOP)/test/synchtest.c
@@ -110,4 +112,6 @@ SRCS+=$(KTOP)/vfs/vfslookup.c
 SRCS+=$(KTOP)/vfs/vfspath.c
 SRCS+=$(KTOP)/vfs/vnode.c
 SRCS+=$(KTOP)/vm/kmalloc.c
+SRCS+=$(KTOP)/vm/objcache.c
+SRCS+=$(KTOP)/vm/swap.c
 SRCS+=$(KTOP)/vm/uw-vmstats.c
@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KMPROF_H_
+#define _OPT_KMPROF_H_
+#define OPT_KMPROF 0
+#endif /* _OPT_KMPROF_H_ */
@@ -44,11 +44,20 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <objcache.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/*
+ * In-memory vnodes are loaded and reclaimed all the time; keep the
+ * freed ones in a cache rather than going back to kmalloc. Everything
+ * in them is set up by sfs_loadvnode, so there is no constructor.
+ */
+static struct objcache sfs_vnode_cache =
+	OBJCACHE_INITIALIZER("sfs_vnode", struct sfs_vnode, NULL, NULL);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +962,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_put(&sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -1110,14 +1119,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped pages go through sfs_read and sfs_write,
+ * so any regular file can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -1685,7 +1695,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_get(&sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1709,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1746,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1757,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		objcache_put(&sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -39,6 +39,58 @@
 #include "opt-A3.h"
 
 struct vnode;
+struct array;
+struct shm_object;
+
+#if OPT_A3
+/*
+ * Page table entries hold the frame's physical address, with flag
+ * bits in the (otherwise zero) page offset bits. An entry of 0 means
+ * no frame. A page that has been paged out holds its swap slot in
+ * place of the frame address, with PTE_SWAPPED set.
+ */
+#define PTE_COW       0x001   /* frame shared copy-on-write; map read-only */
+#define PTE_RDONLY    0x002   /* page is in a read-only region */
+#define PTE_DIRTY     0x004   /* written since it was paged in */
+#define PTE_SWAPPED   0x008   /* not resident; PTE_SWAPSLOT says where */
+#define PTE_EVICTING  0x010   /* being paged out; faults wait */
+#define PTE_SHARED    0x020   /* MAP_SHARED page; fork shares it writable */
+
+#define PTE_SWAPSLOT(pte)  ((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot)   (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+
+/*
+ * Two-level page table, in the MIPS style: the top 10 bits of a user
+ * address index the first level, the next 10 a second-level table of
+ * 1024 entries that fills exactly one page. Second-level tables are
+ * only allocated for the 4M chunks of the address space a process
+ * actually touches.
+ */
+#define PT_L1_SHIFT     22
+#define PT_L2_ENTRIES   1024
+#define PT_L1_ENTRIES   (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L1_INDEX(va) ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va) (((va) >> 12) & (PT_L2_ENTRIES - 1))
+
+/*
+ * A contiguous range of valid user addresses, e.g. one ELF segment,
+ * the stack, the heap or an mmapped file. The first rg_filesize bytes
+ * from rg_filevaddr come from the executable, or from rg_vnode if it
+ * is set, and are paged in on first touch.
+ */
+struct region {
+  vaddr_t rg_vbase;		/* page-aligned */
+  size_t rg_npages;
+  bool rg_writeable;
+  vaddr_t rg_filevaddr;		/* unaligned start of file data */
+  off_t rg_fileoffset;
+  size_t rg_filesize;
+  struct vnode *rg_vnode;	/* mmapped file, or NULL for as_vnode */
+  bool rg_mapped;		/* made by mmap, so munmap may remove it */
+  bool rg_shared;		/* MAP_SHARED: no copy-on-write, written back */
+  struct shm_object *rg_shm;	/* MAP_SHARED: backing; see dumbvm.c */
+};
+#endif
 
 
 /* 
@@ -50,15 +102,13 @@ struct vnode;
 
 struct addrspace {
 #if OPT_A3
-  // Page Table
-  vaddr_t as_vbase1;
-  paddr_t* as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  paddr_t* as_pbase2;
-  size_t as_npages2;
-  paddr_t* as_stackpbase;
-  bool loadelf_completed;
+  struct array *as_regions;	/* struct region *, sorted by base */
+  paddr_t **as_pagetable;	/* PT_L1_ENTRIES second-level tables */
+  struct vnode *as_vnode;	/* executable backing the regions */
+  uint32_t *as_asids;		/* ASID on each cpu, 0 if none yet */
+  struct region *as_heap;	/* sbrk region, above the executable */
+  vaddr_t as_heapbrk;		/* current break, within as_heap */
+  vaddr_t as_nextfault;		/* where a sequential scan faults next */
 #else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -104,6 +154,26 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_segment - record that the first FILESIZE bytes of the
+ *                region at VADDR come from vnode V at OFFSET. The
+ *                pages are read in by vm_fault on first touch rather
+ *                than at exec time.
+ *
+ *    as_sbrk   - move the break (the end of the heap, which starts
+ *                right after the executable) by AMOUNT bytes and hand
+ *                back the old break. Heap pages are zero-filled on
+ *                first touch; pages given back are freed at once.
+ *
+ *    as_mmap   - map LEN bytes of vnode VN from OFFSET (or anonymous
+ *                memory if VN is NULL) at an address of our choosing.
+ *                Pages are read in from the file on first touch.
+ *
+ *    as_munmap - remove a mapping made by as_mmap, writing back
+ *                changes to a MAP_SHARED file mapping.
+ *
+ *    as_msync  - write back changes made through the shared mappings
+ *                of VN.
  */
 
 struct addrspace *as_create(void);
@@ -120,6 +190,18 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_define_segment(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, struct vnode *vn,
+                          off_t offset, size_t len, int prot, int flags,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_msync(struct addrspace *as, struct vnode *vn);
+#endif
 
 
 /*
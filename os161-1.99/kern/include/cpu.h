@@ -33,9 +33,37 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
-#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX, PAGEMAG_SIZE, ASID_* */
 
 
+/*
+ * Scheduler run queue levels (see schedule() in thread.c); level 0
+ * runs first. Dispatch latencies are kept in power-of-two microsecond
+ * buckets, the last one catching everything longer.
+ */
+#define SCHED_NLEVELS     4
+#define SCHED_LATBUCKETS  24
+
+/*
+ * Per-cpu kmalloc caches (see kern/vm/kmalloc.c): each cpu keeps up
+ * to KMCACHE_SIZE free blocks of each of kmalloc's KMCACHE_NSIZES
+ * block sizes, and refills/drains KMCACHE_BATCH at a time.
+ */
+#define KMCACHE_NSIZES 8
+#define KMCACHE_SIZE   16
+#define KMCACHE_BATCH  8
+
+/*
+ * Per-cpu kernel stack pools (see kern/thread/thread.c): each cpu
+ * keeps between STACKPOOL_MIN and STACKPOOL_MAX free stacks, starting
+ * at STACKPOOL_INIT, and retunes the limit every STACKPOOL_INTERVAL
+ * hardclocks.
+ */
+#define STACKPOOL_MIN      1
+#define STACKPOOL_INIT     4
+#define STACKPOOL_MAX      16
+#define STACKPOOL_INTERVAL 100
+
 /*
  * Per-cpu structure
  *
@@ -61,14 +89,79 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Protected by c_pagemag_lock. Used by this cpu, except when
+	 * another drains it (see pagemag_drain in dumbvm.c).
+	 * Cache of free physical pages in front of the coremap.
+	 */
+	struct spinlock c_pagemag_lock;
+	paddr_t c_pagemag[PAGEMAG_SIZE];
+	unsigned c_pagemag_count;	/* Frames in c_pagemag */
+	unsigned c_pagemag_hits;	/* Served without the coremap lock */
+	unsigned c_pagemag_misses;	/* Needed a refill from the coremap */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Cache of free kmalloc blocks of each size; see kmalloc.c.
+	 */
+	void *c_kmcache[KMCACHE_NSIZES][KMCACHE_SIZE];
+	unsigned c_kmcache_count[KMCACHE_NSIZES];
+	unsigned c_kmcache_hits;	/* Served without the kmalloc lock */
+	unsigned c_kmcache_misses;	/* Needed a refill */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Free kernel stacks, ready for thread_fork; see thread.c.
+	 */
+	void *c_stacks[STACKPOOL_MAX];
+	unsigned c_nstacks;		/* Stacks in c_stacks */
+	unsigned c_stackpool_target;	/* Most stacks to keep just now */
+	unsigned c_stackpool_low;	/* Fewest kept this interval */
+	unsigned c_stackpool_empty;	/* Forks that found none, ditto */
+	unsigned c_stackpool_epoch;	/* c_hardclocks when it began */
+	unsigned c_stackpool_hits;	/* Forks served from the pool */
+	unsigned c_stackpool_misses;	/* Forks that used kmalloc */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Address space IDs; see machine/vm.h.
+	 */
+	uint32_t c_asid_last;		/* Last ASID handed out */
+	uint32_t c_asid;		/* ASID now in EntryHi */
+
+	/*
+	 * Written only by this cpu (as_activate, interrupts off), but
+	 * read without a lock by other cpus' tlb_shootdown to decide
+	 * whether this cpu needs a shootdown IPI. as_activate stores
+	 * c_lastas before it reads the address space's ASID, and
+	 * tlb_shootdown clears that ASID before it reads c_lastas, so
+	 * at least one side sees the other's store; this relies on
+	 * the two stores not being reordered past the loads, which
+	 * holds on System/161's in-order cpus.
+	 */
+	struct addrspace *volatile c_lastas; /* Whose ASID is c_asid */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues */
+	unsigned c_runcount;		/* Threads on all of them */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Scheduler statistics.
+	 * Protected by the runqueue lock.
+	 */
+	unsigned c_sched_lat[SCHED_NLEVELS][SCHED_LATBUCKETS];
+	uint32_t c_sched_latmax[SCHED_NLEVELS];	/* Worst, in usec */
+	uint64_t c_sched_latsum[SCHED_NLEVELS];	/* Total, in usec */
+	unsigned c_sched_demotions;	/* Used up a time slice */
+	unsigned c_sched_preemptions;	/* Displaced by a higher level */
+	unsigned c_sched_aged;		/* Moved up for waiting too long */
+	unsigned c_sched_boosts;	/* Moved up on wakeup */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,10 +175,16 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each shootdown posted to the cpu is numbered from
+	 * c_shootdown_posted; c_shootdown_done is the number of the
+	 * last one carried out, so the sender can wait for it.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_posted;
+	volatile unsigned c_shootdown_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +208,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up cpus by software number, 0 .. cpu_numcpus()-1.
+ */
+unsigned cpu_numcpus(void);
+struct cpu *cpu_getcpu(unsigned software_number);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +257,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_all asks the target to invalidate its whole TLB.
+ * Both return a ticket; ipi_tlbshootdown_wait(target, ticket) spins
+ * until the target has done that shootdown. It must be called with
+ * interrupts on and no spinlocks held, or two cpus waiting on each
+ * other could deadlock.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +275,10 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_all(struct cpu *target);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,21 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap().
+ */
+
+/* Page protection, for the PROT argument. */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4	/* accepted but not enforced */
+
+/* Mapping type, for the FLAGS argument: exactly one of these... */
+#define MAP_SHARED    0x0001	/* changes go to the file and are shared */
+#define MAP_PRIVATE   0x0002	/* changes are private copy-on-write */
+#define MAP_TYPE      0x000f
+/* ...optionally with: */
+#define MAP_ANON      0x1000	/* no file; zero-filled memory */
+
+#endif /* _KERN_MMAN_H_ */
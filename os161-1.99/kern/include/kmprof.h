@@ -0,0 +1,38 @@
+#ifndef _KMPROF_H_
+#define _KMPROF_H_
+
+/*
+ * kmalloc call-site profiler (only with "options kmprof").
+ *
+ * kmalloc reports every allocation with the return address of its
+ * caller, and kfree every free; the profiler keeps, per call site,
+ * the live blocks and bytes and how many allocations it has made,
+ * and per size class how much of the live blocks is unused.
+ *
+ *    kmprof_alloc      - record that CALLER got PTR, a block of
+ *                        BLKSIZE bytes in size class SIZECLASS, for
+ *                        a request of REQSIZE bytes.
+ *    kmprof_free       - record that PTR was freed.
+ *    kmprof_bootstrap  - allocate the profiler's tables and start
+ *                        the first allocation-rate interval; called
+ *                        once the VM system and the clock are up.
+ *                        Allocations before this aren't tracked.
+ *    kmprof_printstats - print the top call sites by live bytes and
+ *                        by allocations per second since the last
+ *                        report, and fragmentation per size class.
+ *
+ * Call sites are printed as addresses; use addr2line on the kernel
+ * to find them. A site that only wraps kmalloc (kstrdup, say) is
+ * charged for what its callers allocate.
+ */
+
+/* kmalloc's size classes, plus one for whole-page allocations. */
+#define KMPROF_NCLASSES 14
+
+void kmprof_bootstrap(void);
+void kmprof_alloc(vaddr_t caller, void *ptr, size_t reqsize,
+		  size_t blksize, unsigned sizeclass);
+void kmprof_free(void *ptr);
+void kmprof_printstats(void);
+
+#endif /* _KMPROF_H_ */
@@ -0,0 +1,66 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Typed object caches.
+ *
+ * An object cache hands out objects of one type that are already
+ * constructed: the constructor runs when an object is first
+ * allocated, and a freed object keeps its constructed state (its
+ * spinlocks initialized, its wait channel allocated, and so on) on
+ * the cache's free list until it is handed out again. Only when the
+ * free list is full is an object destructed and kfree'd.
+ *
+ * So a type whose create function allocates and initializes the same
+ * things every time puts those in the constructor, and its destroy
+ * function leaves them as the constructor made them.
+ *
+ * Caches are defined statically with OBJCACHE_INITIALIZER, so they
+ * can be used from the very start of boot:
+ *
+ *     static struct objcache lock_cache =
+ *         OBJCACHE_INITIALIZER("lock", struct lock, lock_ctor, lock_dtor);
+ *
+ *    objcache_get        - return a constructed object, or NULL if out
+ *                          of memory (or the constructor failed).
+ *    objcache_put        - give an object back, in constructed state.
+ *    objcache_printstats - print statistics for every cache used so far.
+ *
+ * The constructor returns 0 or an error code; either it or the
+ * destructor may be NULL. Neither is called with a spinlock held.
+ */
+
+#include <spinlock.h>
+
+#define OBJCACHE_DEPTH 32	/* constructed objects kept per cache */
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	void *oc_free[OBJCACHE_DEPTH];	/* constructed, not in use */
+	unsigned oc_nfree;
+
+	/* statistics, under oc_lock */
+	unsigned oc_gets;		/* objects handed out... */
+	unsigned oc_hits;		/* ...already constructed */
+	unsigned oc_ctors;		/* constructor calls */
+	unsigned oc_dtors;		/* destructor calls */
+	unsigned oc_inuse;		/* handed out and not put back */
+
+	struct objcache *oc_next;	/* all caches, for statistics */
+	bool oc_listed;
+};
+
+#define OBJCACHE_INITIALIZER(name, type, ctor, dtor) \
+	{ name, sizeof(type), ctor, dtor, SPINLOCK_INITIALIZER, \
+	  { NULL }, 0, 0, 0, 0, 0, 0, NULL, false }
+
+void *objcache_get(struct objcache *oc);
+void objcache_put(struct objcache *oc, void *obj);
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
@@ -39,6 +39,7 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <synch.h>
 #include <array.h>
  
@@ -69,6 +70,16 @@ Exit = 2
 /*
  * Process structure.
  */
+#if OPT_A3
+/*
+ * Open files. Descriptors below PROC_FIRSTFILE are the console (see
+ * sys_write); the rest index p_files. So far files are only opened
+ * to be mmapped, so there are no file offsets.
+ */
+#define PROC_FIRSTFILE  3
+#define PROC_MAXFILES   16
+#endif
+
 struct proc {
 	char *p_name;			/* Name of this process */
 	struct spinlock p_lock;		/* Lock for this structure */
@@ -99,6 +110,11 @@ struct proc {
   struct vnode *console;                /* a vnode for the console device */
 #endif
 
+#if OPT_A3
+	struct vnode *p_files[PROC_MAXFILES];	/* open files, or NULL */
+	int p_fileflags[PROC_MAXFILES];		/* ...and their open modes */
+#endif
+
 	/* add more material here as needed */
 };
 
@@ -125,6 +141,14 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+#if OPT_A3
+/* Give a new process (from fork) the same open files as another. */
+void proc_copyfiles(struct proc *dst, struct proc *src);
+
+/* Look up an open file; NULL if FD isn't one. Sets *FLAGS to its mode. */
+struct vnode *proc_getfile(struct proc *proc, int fd, int *flags);
+#endif
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
@@ -0,0 +1,50 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space: page-sized slots on a raw disk, handed out from a
+ * bitmap. The page replacement policy lives in the VM system; this
+ * is only slot management and I/O.
+ *
+ * Pages written to a slot are kept compressed in memory when they
+ * compress well and there is room, and only go to disk when there
+ * isn't; see swap.c. Without a swap disk, slots are memory-only.
+ *
+ *    swap_bootstrap - open the swap device. If it isn't there the
+ *                     system runs without swap.
+ *    swap_enabled   - true if pages can be swapped out.
+ *    swap_alloc     - find a free slot and mark it used.
+ *    swap_free      - release a slot.
+ *    swap_read      - read slot SLOT into physical page PADDR.
+ *    swap_write     - write physical page PADDR into slot SLOT.
+ *    swap_dup       - copy slot SLOT into a newly allocated slot.
+ *    swap_reap      - free pool buffers left behind by swap_free.
+ *    swap_usage     - slots in use and total, for statistics.
+ *    swap_poolusage - pages in the compressed pool, and the heap it
+ *                     is using and may use, for statistics.
+ *
+ * swap_read, swap_write and swap_dup sleep and must not be called
+ * with spinlocks held, and neither may swap_reap; swap_alloc and
+ * swap_free may be. swap_write
+ * is for the evictor only (it relies on the evictor's lock to keep
+ * its allocations from evicting).
+ */
+
+#define SWAP_DEVICE   "lhd1raw:"
+#define SWAP_NOSLOT   0xffffffff
+
+#define ZSWAP_POOLDIV 4		/* pool may use 1/ZSWAP_POOLDIV of RAM */
+#define ZSWAP_MAXLEN  2048	/* largest compressed page kept */
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_read(unsigned slot, paddr_t paddr);
+int swap_write(unsigned slot, paddr_t paddr);
+int swap_dup(unsigned slot, unsigned *ret);
+void swap_reap(void);
+void swap_usage(unsigned *used, unsigned *total);
+void swap_poolusage(unsigned *npages, size_t *bytes, size_t *maxbytes);
+
+#endif /* _SWAP_H_ */
@@ -31,6 +31,7 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -44,7 +45,8 @@ void syscall(struct trapframe *tf);
  * Support functions.
  */
 
-/* Helper for fork(). You write this. */
+/* Helpers for fork(). The copy from trapframe_dup is freed by the child. */
+struct trapframe *trapframe_dup(struct trapframe *tf);
 void enter_forked_process(void *tf, unsigned long data);
 
 /* Enter user mode. Does not return. */
@@ -72,4 +74,14 @@ int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(const char *program, char **args);
 #endif /* OPT_A2 */
 
+#if OPT_A3
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fdesc);
+int sys_fsync(int fdesc);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+#endif /* OPT_A3 */
+
 #endif /* _SYSCALL_H_ */
@@ -79,6 +79,8 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
+int coremapbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
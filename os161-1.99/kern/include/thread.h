@@ -101,6 +101,17 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields; see schedule() in thread.c. Protected by
+	 * the runqueue lock of t_cpu while the thread is runnable.
+	 */
+	unsigned t_level;		/* Run queue level, 0 = highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_queuedat;		/* c_hardclocks when queued */
+	bool t_readytimed;		/* t_ready* are valid */
+	time_t t_readysecs;		/* When last made runnable */
+	uint32_t t_readynsecs;
+
 	/*
 	 * Public fields
 	 */
@@ -130,6 +141,12 @@ void thread_panic(void);
 /* Call during system shutdown to offline other CPUs. */
 void thread_shutdown(void);
 
+/* Print each cpu's kernel stack pool (see thread.c). */
+void thread_stackpool_printstats(void);
+
+/* Print the scheduler's dispatch latencies and counters. */
+void thread_sched_printstats(void);
+
 /*
  * Make a new thread, which will start executing at "func". The thread
  * will belong to the process "proc", or to the current thread's
@@ -157,6 +174,13 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a hardclock to the current thread, and yield if its time
+ * slice is used up or a higher-priority thread is waiting. Called
+ * from hardclock().
+ */
+void thread_timeslice(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
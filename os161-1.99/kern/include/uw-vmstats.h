@@ -10,11 +10,13 @@
 /* Tracks stats on user programs */
 
 /* NOTE !!!!!! WARNING !!!!!
+ * Each cpu counts into its own slots, which are only added up when
+ * the stats are printed, so counting takes no lock.
  * All of the functions (except vmstats_print) whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * assume that interrupts are already off
+ * (e.g., because the caller holds a spinlock).
  * All of the functions whose names do not begin
- * with '_' ensure atomicity locally (except vmstats_print).
+ * with '_' turn interrupts off locally (except vmstats_print).
  *
  * Generally you will use the functions whose names
  * do not begin with '_'.
@@ -36,21 +38,75 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_ASID_ROLLOVER         (10)
+#define VMSTAT_TLB_FLUSH_AVOIDED     (11)
+#define VMSTAT_TLB_SHOOTDOWN         (12)
+#define VMSTAT_TLB_SHOOTDOWN_ALL     (13)
+#define VMSTAT_TLB_SHOOTDOWN_USEC    (14)
+#define VMSTAT_MMAP_FILE_READ        (15)
+#define VMSTAT_MMAP_FILE_WRITE       (16)
+#define VMSTAT_TEXT_SHARED           (17)
+#define VMSTAT_ZEROPOOL_HIT          (18)
+#define VMSTAT_ZEROPOOL_MISS         (19)
+#define VMSTAT_ZEROPOOL_FILL         (20)
+#define VMSTAT_FAULTAROUND_MAP       (21)
+#define VMSTAT_FAULTAROUND_FILL      (22)
+#define VMSTAT_MERGE                 (23)
+#define VMSTAT_UNMERGE               (24)
+#define VMSTAT_ZSWAP_STORE           (25)
+#define VMSTAT_ZSWAP_SAMEFILL        (26)
+#define VMSTAT_ZSWAP_BYTES           (27)
+#define VMSTAT_ZSWAP_LOAD            (28)
+#define VMSTAT_ZSWAP_SPILL           (29)
+#define VMSTAT_COUNT                 (30)
+
+/* TLB misses served by a machine-dependent fast refill path, which
+ * bumps vmstats_fastrefills[its cpu number] itself instead of calling
+ * vmstats_inc. vmstats_print adds them to VMSTAT_TLB_FAULT,
+ * VMSTAT_TLB_FAULT_REPLACE and VMSTAT_TLB_RELOAD.
+ */
+extern unsigned int vmstats_fastrefills[];
 
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
-void vmstats_init(void);                     /* uses locking */
-void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
+void vmstats_init(void);                     /* turns interrupts off */
+void _vmstats_init(void);                    /* interrupts must be off */
 
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* turns interrupts off */
+void _vmstats_inc(unsigned int index);   /* interrupts must be off */
+
+/* Add AMOUNT to the specified count, for stats that accumulate a total
+ * Example use:
+ *   vmstats_add(VMSTAT_TLB_SHOOTDOWN_USEC, usecs);
+ */
+void vmstats_add(unsigned int index, unsigned int amount);    /* turns interrupts off */
+void _vmstats_add(unsigned int index, unsigned int amount);   /* interrupts must be off */
+
+/* Latency histograms, timed with gettime() (the ltimer on sys161).
+ * Bucket 0 counts times under 1 usec, bucket i times from 2^(i-1) up
+ * to 2^i usec, and the last bucket everything longer.
+ */
+#define VMHIST_FAULT                  (0)
+#define VMHIST_EXEC                   (1)
+#define VMHIST_FORK                   (2)
+#define VMHIST_COUNT                  (3)
+#define VMHIST_BUCKETS               (24)
+
+/* Record one event that took USECS microseconds, or that started at
+ * SECS/NSECS (from gettime) and has just finished
+ * Example use:
+ *   gettime(&secs, &nsecs);
+ *   ...
+ *   vmstats_hist_since(VMHIST_FORK, secs, nsecs);
+ */
+void vmstats_hist_add(unsigned int hist, uint32_t usecs);                  /* turns interrupts off */
+void vmstats_hist_since(unsigned int hist, time_t secs, uint32_t nsecs);  /* turns interrupts off */
 
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
@@ -50,7 +50,10 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>  
+#include <kern/errno.h>
+#include <objcache.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -78,6 +81,61 @@ struct semaphore *no_proc_sem;
 
 
 
+/*
+ * Proc structures come from an object cache. The parts that cost an
+ * allocation to set up (the thread array, and for A2 the child list,
+ * its CV and pLock) are made by proc_ctor once and survive being put
+ * back in the cache; proc_create only fills in the per-process fields.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+#if OPT_A2
+	proc->p_cv = cv_create("child_cv");
+	proc->children = array_create();
+	proc->pLock = lock_create("pLock");
+	if (proc->p_cv == NULL || proc->children == NULL ||
+	    proc->pLock == NULL) {
+		if (proc->p_cv != NULL) {
+			cv_destroy(proc->p_cv);
+		}
+		if (proc->children != NULL) {
+			array_destroy(proc->children);
+		}
+		if (proc->pLock != NULL) {
+			lock_destroy(proc->pLock);
+		}
+		spinlock_cleanup(&proc->p_lock);
+		threadarray_cleanup(&proc->p_threads);
+		return ENOMEM;
+	}
+#endif /* OPT_A2 */
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_A2
+	lock_destroy(proc->pLock);
+	array_destroy(proc->children);
+	cv_destroy(proc->p_cv);
+#endif /* OPT_A2 */
+	spinlock_cleanup(&proc->p_lock);
+	threadarray_cleanup(&proc->p_threads);
+}
+
+static struct objcache proc_cache =
+	OBJCACHE_INITIALIZER("proc", struct proc, proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -86,20 +144,20 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+#if OPT_A3
+	int i;
+#endif
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_get(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_put(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -111,19 +169,21 @@ proc_create(const char *name)
 	proc->exitCode = 0;
 	proc->status = Alive;
 	proc->parent = NULL;
-	proc->p_cv = cv_create("child_cv");
-	proc->children = array_create();
-	proc->pLock = lock_create("pLock");
-	if (proc->pLock == NULL) {
-		kfree(proc);
-		return NULL;
-	}
+	/* p_cv, children and pLock come constructed from the cache */
+	KASSERT(array_num(proc->children) == 0);
 #endif /* OPT_A2 */
 
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
 
+#if OPT_A3
+	for (i = 0; i < PROC_MAXFILES; i++) {
+		proc->p_files[i] = NULL;
+		proc->p_fileflags[i] = 0;
+	}
+#endif
+
 	return proc;
 }
 
@@ -133,6 +193,10 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+#if OPT_A3
+	int i;
+#endif
+
 	/*
          * note: some parts of the process structure, such as the address space,
          *  are destroyed in sys_exit, before we get here
@@ -179,12 +243,8 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 #if OPT_A2
-	while (array_num(proc->children) > 0) {
-		array_remove(proc->children, 0);
-	}	
-	array_destroy(proc->children);
-	cv_destroy(proc->p_cv);
-	lock_destroy(proc->pLock);
+	/* empty the child list; it and the sync objects stay with the cache */
+	array_setsize(proc->children, 0);
 
 #endif /* OPT_A2 */
 
@@ -194,11 +254,24 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+#if OPT_A3
+	for (i = 0; i < PROC_MAXFILES; i++) {
+		if (proc->p_files[i] != NULL) {
+			vfs_close(proc->p_files[i]);
+			proc->p_files[i] = NULL;
+		}
+	}
+#endif
+
+	/*
+	 * The thread array and p_lock stay set up while cached
+	 * (proc_dtor cleans them up), so only check them here.
+	 */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(!spinlock_do_i_hold(&proc->p_lock));
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_put(&proc_cache, proc);
 
 #if OPT_A2
 	proc = NULL;
@@ -323,6 +396,38 @@ proc_create_runprogram(const char *name)
 	return proc;
 }
 
+#if OPT_A3
+/*
+ * Share SRC's open files with DST, which has none yet. Like the rest
+ * of fork, this assumes nobody else is using either process.
+ */
+void
+proc_copyfiles(struct proc *dst, struct proc *src)
+{
+	int i;
+
+	for (i = PROC_FIRSTFILE; i < PROC_MAXFILES; i++) {
+		KASSERT(dst->p_files[i] == NULL);
+		if (src->p_files[i] != NULL) {
+			VOP_INCREF(src->p_files[i]);
+			dst->p_files[i] = src->p_files[i];
+			dst->p_fileflags[i] = src->p_fileflags[i];
+		}
+	}
+}
+
+struct vnode *
+proc_getfile(struct proc *proc, int fd, int *flags)
+{
+	if (fd < PROC_FIRSTFILE || fd >= PROC_MAXFILES ||
+	    proc->p_files[fd] == NULL) {
+		return NULL;
+	}
+	*flags = proc->p_fileflags[fd];
+	return proc->p_files[fd];
+}
+#endif
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -49,7 +49,14 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
+#include <swap.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
 
 
 /*
@@ -124,11 +131,20 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+#if OPT_KMPROF
+	kmprof_bootstrap();
+#endif
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+#if OPT_A3
+	/* Without lhd1, swap is the compressed in-memory pool only */
+	swap_bootstrap();
+	vm_merge_bootstrap();
+#endif
+
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -153,6 +169,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
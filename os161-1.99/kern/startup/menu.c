@@ -39,12 +39,20 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vm.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <uw-vmstats.h>
+#include <objcache.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -397,10 +405,97 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	thread_stackpool_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	objcache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_sched_printstats();
+
+	return 0;
+}
+
+#if OPT_KMPROF
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmprof_printstats();
+
+	return 0;
+}
+#endif
+
+#if OPT_A3
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstats_print();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		vm_faultaround_set(atoi(args[1]));
+	}
+
+	if (vm_faultaround_get() == 0) {
+		kprintf("Fault-around is off\n");
+	}
+	else {
+		kprintf("Fault-around maps %u pages (at most %u)\n",
+			vm_faultaround_get(), FAULTAROUND_MAX);
+	}
+	return 0;
+}
+#endif
+
 static
 int
 cmd_dth(int nargs, char **args) {
@@ -473,6 +568,10 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
+#if OPT_A3
+	"[cm1] Coremap alloc benchmark       ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -522,6 +621,16 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[oc] Object cache stats             ",
+	"[sch] Scheduler stats               ",
+#if OPT_KMPROF
+	"[kmp] kmalloc call-site profile     ",
+#endif
+#if OPT_A3
+	"[cm] Coremap stats                  ",
+	"[vs] VM stats and latencies         ",
+	"[fa] Fault-around pages (0 = off)   ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -579,12 +688,26 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "oc",         cmd_objcachestats },
+	{ "sch",        cmd_schedstats },
+#if OPT_KMPROF
+	{ "kmp",        cmd_kmprof },
+#endif
+#if OPT_A3
+	{ "cm",         cmd_coremapstats },
+	{ "vs",         cmd_vmstats },
+	{ "fa",         cmd_faultaround },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
+#if OPT_A3
+	{ "cm1",	coremapbench },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -8,6 +8,13 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kern/fcntl.h>
+#include <limits.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#endif
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +65,78 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A3
+/*
+ * open, close and fsync. Files are only opened so they can be
+ * mmapped: there is no read, write or lseek on them yet.
+ */
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  char *path;
+  struct vnode *vn;
+  int fd, res;
+
+  for (fd = PROC_FIRSTFILE; fd < PROC_MAXFILES; fd++) {
+    if (curproc->p_files[fd] == NULL) {
+      break;
+    }
+  }
+  if (fd == PROC_MAXFILES) {
+    return EMFILE;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr(upath, path, PATH_MAX, NULL);
+  if (res == 0) {
+    res = vfs_open(path, flags, mode, &vn);
+  }
+  kfree(path);
+  if (res) {
+    return res;
+  }
+
+  curproc->p_files[fd] = vn;
+  curproc->p_fileflags[fd] = flags & O_ACCMODE;
+  *retval = fd;
+  return 0;
+}
+
+int
+sys_close(int fdesc)
+{
+  struct vnode *vn;
+  int flags;
+
+  vn = proc_getfile(curproc, fdesc, &flags);
+  if (vn == NULL) {
+    return EBADF;
+  }
+  /* mappings of the file hold references of their own */
+  curproc->p_files[fdesc] = NULL;
+  vfs_close(vn);
+  return 0;
+}
+
+int
+sys_fsync(int fdesc)
+{
+  struct vnode *vn;
+  int flags, res;
+
+  vn = proc_getfile(curproc, fdesc, &flags);
+  if (vn == NULL) {
+    return EBADF;
+  }
+  /* push out this process's changes through shared mappings first */
+  res = as_msync(curproc->p_addrspace, vn);
+  if (res) {
+    return res;
+  }
+  return VOP_FSYNC(vn);
+}
+#endif /* OPT_A3 */
@@ -82,6 +82,26 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_A3
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	/*
+	 * Nothing is read here. The address space remembers where the
+	 * segment lives in the file and vm_fault reads each page in
+	 * the first time it is touched. as_define_region has already
+	 * checked that the segment lies in user space, which uiomove
+	 * used to catch.
+	 */
+	(void)is_executable;
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_segment(as, v, offset, vaddr, filesize);
+#else
 	struct iovec iov;
 	struct uio u;
 	int result;
@@ -144,6 +164,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_A3 */
 }
 
 /*
@@ -304,7 +325,6 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 	*entrypoint = eh.e_entry;
 #if OPT_A3
-	as->loadelf_completed = true;
 	as_activate();
 #endif	
 	
@@ -11,6 +11,10 @@
 #include <copyinout.h>
 #include <kern/syscall.h>
 #include <machine/trapframe.h>
+#if OPT_A3
+#include <clock.h>
+#include <uw-vmstats.h>
+#endif
 
 #if OPT_A2
 #include <vfs.h>
@@ -19,6 +23,12 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
 	
 	// create child proc
 	struct proc *proc;
+#if OPT_A3
+	time_t start_secs;
+	uint32_t start_nsecs;
+
+	gettime(&start_secs, &start_nsecs);
+#endif
 
 	lock_acquire(PIDLock);
 	PIDCounter++;
@@ -28,6 +38,9 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
 	if (proc == NULL) {
 		return SYS_fork;
  	}
+#if OPT_A3
+	proc_copyfiles(proc, curproc);
+#endif
 	
 	lock_acquire(proc->pLock);
 	// parent-child relationship
@@ -38,6 +51,10 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
 	struct addrspace *child_addrspace;
 	int copy_result = as_copy(curproc->p_addrspace, &child_addrspace);
 	if (copy_result != 0) {
+		array_remove(curproc->children,
+			     array_num(curproc->children) - 1);
+		lock_release(proc->pLock);
+		proc_destroy(proc);
 		return copy_result;
 	}
         proc->p_addrspace = child_addrspace;	
@@ -46,13 +63,25 @@ int sys_fork(struct trapframe *tf, pid_t *retval) {
 	*retval = proc->PID;
 
 	// make a copy of the child trapframe
-        struct trapframe *child_tf = kmalloc(sizeof(struct trapframe));
-        *child_tf = *tf;
+        struct trapframe *child_tf = trapframe_dup(tf);
+	if (child_tf == NULL) {
+		/* the child never ran: take it back off our list and free it */
+		array_remove(curproc->children,
+			     array_num(curproc->children) - 1);
+		proc->p_addrspace = NULL;
+		lock_release(proc->pLock);
+		as_destroy(child_addrspace);
+		proc_destroy(proc);
+		return ENOMEM;
+	}
 	
 	lock_release(proc->pLock);
 	
 	// create a thread for the child process
 	thread_fork("[child thread]", proc, enter_forked_process, child_tf, 0);
+#if OPT_A3
+	vmstats_hist_since(VMHIST_FORK, start_secs, start_nsecs);
+#endif
 	
 	return 0;
 }
@@ -62,6 +91,12 @@ int sys_execv(const char *program, char **args) {
         struct vnode *v;
         vaddr_t entrypoint, stackptr;
         int result;
+#if OPT_A3
+	time_t start_secs;
+	uint32_t start_nsecs;
+
+	gettime(&start_secs, &start_nsecs);
+#endif
 	
 	// Copy the program name into kernel space
 	char *kern_program = kmalloc((strlen(program) + 1) * sizeof (char));
@@ -203,6 +238,9 @@ int sys_execv(const char *program, char **args) {
 		kfree(kern_args[i]);
 	}
 	kfree(kern_args);
+#if OPT_A3
+	vmstats_hist_since(VMHIST_EXEC, start_secs, start_nsecs);
+#endif
 	//kprintf("%p\n", (void *) top_of_stack);
 	/////////////////////////////////////////////////////////////
         /* Warp to user mode. */
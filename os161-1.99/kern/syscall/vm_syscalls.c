@@ -0,0 +1,79 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+
+/*
+ * Memory management system calls. The work is done by the VM system;
+ * these just find the current address space and check arguments.
+ */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * The address hint is ignored; the VM system picks a free range.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *vn;
+	int mode;
+
+	(void)addr;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	if ((flags & MAP_TYPE) != MAP_SHARED &&
+	    (flags & MAP_TYPE) != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	vn = NULL;
+	if ((flags & MAP_ANON) == 0) {
+		vn = proc_getfile(curproc, fd, &mode);
+		if (vn == NULL) {
+			return EBADF;
+		}
+		/* pages are read in from the file, whatever PROT says */
+		if (mode == O_WRONLY) {
+			return EACCES;
+		}
+		if ((flags & MAP_TYPE) == MAP_SHARED &&
+		    (prot & PROT_WRITE) && mode != O_RDWR) {
+			return EACCES;
+		}
+	}
+
+	return as_mmap(as, vn, offset, len, prot, flags, retval);
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
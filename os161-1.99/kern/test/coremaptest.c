@@ -0,0 +1,141 @@
+/*
+ * Physical page allocator benchmark.
+ *
+ * Each thread repeatedly builds and tears down something shaped like
+ * a small process image - a handful of single pages for text, data
+ * and stack plus a couple of short multi-page runs like the ones
+ * kmalloc asks for - the way widefork/forkbomb churn the coremap.
+ * Reports page allocations per second across all threads.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <vm.h>
+#include <test.h>
+
+#define CM_NTHREADS   8
+#define CM_NROUNDS    500
+#define CM_IMAGE      20	/* allocations per simulated process */
+
+static struct semaphore *cm_donesem;
+static volatile unsigned long cm_allocs;
+static volatile unsigned long cm_failures;
+static struct spinlock cm_countlock = SPINLOCK_INITIALIZER;
+
+/* run lengths for one image: mostly single pages, a few short runs */
+static const unsigned cm_runs[CM_IMAGE] = {
+	1, 1, 1, 1, 1, 2, 1, 1, 1, 1,
+	1, 1, 3, 1, 1, 1, 1, 1, 4, 1,
+};
+
+static
+void
+coremapthread(void *junk, unsigned long nrounds)
+{
+	vaddr_t pages[CM_IMAGE];
+	unsigned long allocs = 0, failures = 0;
+	unsigned long r;
+	unsigned i;
+
+	(void)junk;
+
+	for (r = 0; r < nrounds; r++) {
+		for (i = 0; i < CM_IMAGE; i++) {
+			pages[i] = alloc_kpages(cm_runs[i]);
+			if (pages[i] == 0) {
+				failures++;
+			}
+			else {
+				allocs++;
+			}
+		}
+		/* free in a different order than we allocated */
+		for (i = 0; i < CM_IMAGE; i += 2) {
+			if (pages[i] != 0) {
+				free_kpages(pages[i]);
+			}
+		}
+		for (i = 1; i < CM_IMAGE; i += 2) {
+			if (pages[i] != 0) {
+				free_kpages(pages[i]);
+			}
+		}
+	}
+
+	spinlock_acquire(&cm_countlock);
+	cm_allocs += allocs;
+	cm_failures += failures;
+	spinlock_release(&cm_countlock);
+
+	V(cm_donesem);
+}
+
+int
+coremapbench(int nargs, char **args)
+{
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	unsigned long nthreads = CM_NTHREADS, nrounds = CM_NROUNDS;
+	unsigned long usecs, rate;
+	unsigned freebefore, freeafter;
+	unsigned long i;
+	int result;
+
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		nrounds = atoi(args[2]);
+	}
+	if (nthreads == 0 || nrounds == 0) {
+		kprintf("Usage: cm1 [nthreads [rounds]]\n");
+		return EINVAL;
+	}
+
+	cm_donesem = sem_create("coremapbench", 0);
+	if (cm_donesem == NULL) {
+		panic("coremapbench: sem_create failed\n");
+	}
+	cm_allocs = 0;
+	cm_failures = 0;
+
+	kprintf("Starting coremap benchmark: %lu threads, %lu rounds...\n",
+		nthreads, nrounds);
+	freebefore = coremap_freeframes();
+	gettime(&s1, &ns1);
+
+	for (i = 0; i < nthreads; i++) {
+		result = thread_fork("coremapbench", NULL,
+				     coremapthread, NULL, nrounds);
+		if (result) {
+			panic("coremapbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		P(cm_donesem);
+	}
+
+	gettime(&s2, &ns2);
+	freeafter = coremap_freeframes();
+	sem_destroy(cm_donesem);
+	cm_donesem = NULL;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	usecs = secs * 1000000 + nsecs / 1000;
+	rate = usecs ? (unsigned long)(((uint64_t)cm_allocs * 1000000) / usecs)
+		: 0;
+
+	kprintf("coremap: %lu allocs, %lu failed, %lu.%06lu s, "
+		"%lu allocs/sec\n", cm_allocs, cm_failures,
+		(unsigned long)secs, (unsigned long)(nsecs / 1000), rate);
+	kprintf("coremap: free frames before %u, after %u\n",
+		freebefore, freeafter);
+	kprintf("coremap benchmark done.\n");
+
+	return 0;
+}
@@ -31,7 +31,10 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -45,12 +48,19 @@
  *
  * mallocstress does the same thing, but from NTHREADS different
  * threads at once.
+ *
+ * mallocbench measures throughput: with 1, 2, ... threads, up to one
+ * per cpu, each thread allocates and frees KB_BATCH small blocks of
+ * mixed sizes, KB_NROUNDS times over.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+#define KB_NROUNDS 2000
+#define KB_BATCH   32
+
 static
 void
 mallocthread(void *sm, unsigned long num)
@@ -137,3 +147,96 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+static struct semaphore *kb_donesem;
+
+/* sizes for one batch: mostly small, like locks, cvs and strings */
+static const size_t kb_sizes[KB_BATCH] = {
+	16, 24, 32, 16, 64, 48, 16, 128, 32, 16, 256, 24, 16, 40, 96, 512,
+	16, 32, 16, 64, 24, 16, 1024, 32, 16, 48, 16, 128, 32, 16, 200, 64,
+};
+
+static
+void
+mallocbenchthread(void *junk, unsigned long nrounds)
+{
+	void *ptrs[KB_BATCH];
+	unsigned long r;
+	unsigned i;
+
+	(void)junk;
+
+	for (r = 0; r < nrounds; r++) {
+		for (i = 0; i < KB_BATCH; i++) {
+			ptrs[i] = kmalloc(kb_sizes[i]);
+			if (ptrs[i] == NULL) {
+				panic("mallocbench: kmalloc returned NULL\n");
+			}
+		}
+		for (i = 0; i < KB_BATCH; i++) {
+			kfree(ptrs[i]);
+		}
+	}
+	V(kb_donesem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	unsigned long nrounds = KB_NROUNDS;
+	unsigned long usecs, ops, rate;
+	unsigned ncpus, nthreads, i;
+	int result;
+
+	if (nargs > 1) {
+		nrounds = atoi(args[1]);
+	}
+	if (nrounds == 0) {
+		kprintf("Usage: km3 [rounds]\n");
+		return EINVAL;
+	}
+
+	kb_donesem = sem_create("mallocbench", 0);
+	if (kb_donesem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	ncpus = cpu_numcpus();
+	kprintf("Starting kmalloc benchmark: %lu rounds of %u blocks, "
+		"up to %u threads...\n", nrounds, KB_BATCH, ncpus);
+
+	for (nthreads = 1; nthreads <= ncpus; nthreads++) {
+		gettime(&s1, &ns1);
+		for (i = 0; i < nthreads; i++) {
+			result = thread_fork("mallocbench", NULL,
+					     mallocbenchthread, NULL, nrounds);
+			if (result) {
+				panic("mallocbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i = 0; i < nthreads; i++) {
+			P(kb_donesem);
+		}
+		gettime(&s2, &ns2);
+
+		getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+		usecs = secs * 1000000 + nsecs / 1000;
+		/* one kmalloc and one kfree per block */
+		ops = nthreads * nrounds * KB_BATCH * 2;
+		rate = usecs ? (unsigned long)(((uint64_t)ops * 1000000) /
+					      usecs) : 0;
+		kprintf("kmalloc: %u threads: %lu.%06lu s, %lu ops/sec, "
+			"%lu ops/sec/thread\n", nthreads,
+			(unsigned long)secs, (unsigned long)(nsecs / 1000),
+			rate, rate / nthreads);
+	}
+
+	sem_destroy(kb_donesem);
+	kb_donesem = NULL;
+	kprintf("kmalloc benchmark done.\n");
+
+	return 0;
+}
@@ -218,7 +218,7 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
-          /* VMSTAT_PAGE_FAULT_DISK = VMSTAT_ELF_FILE_READ + VMSTAT_SWAP_FILE_READ */
+          /* VMSTAT_PAGE_FAULT_DISK = VMSTAT_ELF_FILE_READ + VMSTAT_SWAP_FILE_READ + VMSTAT_MMAP_FILE_READ */
           case VMSTAT_PAGE_FAULT_DISK:
             if (i % 2 == 0) {
                vmstats_inc(j);
@@ -232,17 +232,46 @@ vmstats_thread(void *junk, unsigned long num)
             break;
 
           case VMSTAT_SWAP_FILE_READ:
-            if (i % 4 == 0) {
+            if (i % 8 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_MMAP_FILE_READ:
+            if (i % 8 == 0) {
                vmstats_inc(j);
             }
             break;
 
           case VMSTAT_SWAP_FILE_WRITE:
+          case VMSTAT_MMAP_FILE_WRITE:
             if (i % 8 == 0) {
                vmstats_inc(j);
             }
             break;
 
+          /* Not cross-checked against anything */
+          case VMSTAT_ASID_ROLLOVER:
+          case VMSTAT_TLB_FLUSH_AVOIDED:
+          case VMSTAT_TLB_SHOOTDOWN:
+          case VMSTAT_TLB_SHOOTDOWN_ALL:
+          case VMSTAT_TLB_SHOOTDOWN_USEC:
+          case VMSTAT_TEXT_SHARED:
+          case VMSTAT_ZEROPOOL_HIT:
+          case VMSTAT_ZEROPOOL_MISS:
+          case VMSTAT_ZEROPOOL_FILL:
+          case VMSTAT_FAULTAROUND_MAP:
+          case VMSTAT_FAULTAROUND_FILL:
+          case VMSTAT_MERGE:
+          case VMSTAT_UNMERGE:
+          case VMSTAT_ZSWAP_STORE:
+          case VMSTAT_ZSWAP_SAMEFILL:
+          case VMSTAT_ZSWAP_BYTES:
+          case VMSTAT_ZSWAP_LOAD:
+          case VMSTAT_ZSWAP_SPILL:
+            vmstats_inc(j);
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
@@ -33,17 +33,63 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
+
+/*
+ * Semaphores, locks and CVs come from object caches, so that their
+ * wait channels (and spinlocks) are allocated and initialized once
+ * and kept while the object sits in the cache. Only the name is new
+ * each time.
+ */
+static int sem_ctor(void *obj);
+static void sem_dtor(void *obj);
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+
+static struct objcache sem_cache =
+	OBJCACHE_INITIALIZER("semaphore", struct semaphore, sem_ctor, sem_dtor);
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", struct lock, lock_ctor, lock_dtor);
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", struct cv, cv_ctor, cv_dtor);
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create("semaphore");
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,25 +97,18 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = objcache_get(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                objcache_put(&sem_cache, sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,11 +119,11 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* nobody may be waiting on it or holding its spinlock */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+	wchan_setname(sem->sem_wchan, "semaphore");
         kfree(sem->sem_name);
-        kfree(sem);
+        objcache_put(&sem_cache, sem);
 }
 
 void 
@@ -147,35 +186,49 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->spin);
+	lock->held = false;
+	lock->owner = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->spin);
+	wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = objcache_get(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                objcache_put(&lock_cache, lock);
                 return NULL;
         }
         
-        // add stuff here as needed
-	
-	lock->held = false;
-	lock->owner = NULL;
-	
-	lock->lk_wchan = wchan_create(lock->lk_name);
-        if (lock->lk_wchan == NULL) {
-                kfree(lock->lk_name);
-                kfree(lock);
-                return NULL;
-        }
-        
-        spinlock_init(&lock->spin);       
+	wchan_setname(lock->lk_wchan, lock->lk_name);
         return lock;
 }
 
@@ -184,11 +237,12 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
-        // add stuff here as needed
-	spinlock_cleanup(&lock->spin);
-        wchan_destroy(lock->lk_wchan);
+	/* back in the state lock_ctor left it in */
+	KASSERT(!lock->held && lock->owner == NULL);
+	KASSERT(wchan_isempty(lock->lk_wchan));
+	wchan_setname(lock->lk_wchan, "lock");
         kfree(lock->lk_name);
-        kfree(lock);
+        objcache_put(&lock_cache, lock);
 }
 
 void
@@ -238,31 +292,45 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create("cv");
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = objcache_get(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
-                return NULL;
-        }
-        
-        // add stuff here as needed
-	
-	cv->cv_wchan = wchan_create(cv->cv_name);
-        if (cv->cv_wchan == NULL) {
-                kfree(cv->cv_name);
-                kfree(cv);
+                objcache_put(&cv_cache, cv);
                 return NULL;
         }
         
+	wchan_setname(cv->cv_wchan, cv->cv_name);
         return cv;
 }
 
@@ -271,11 +339,10 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
-	
-	wchan_destroy(cv->cv_wchan);
+	KASSERT(wchan_isempty(cv->cv_wchan));
+	wchan_setname(cv->cv_wchan, "cv");
         kfree(cv->cv_name);
-        kfree(cv);
+        objcache_put(&cv_cache, cv);
 }
 
 void
@@ -48,8 +48,11 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
+#include <clock.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <objcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +67,20 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Threads and wait channels come from object caches. A cached thread
+ * keeps its list node (which points back at the thread) and its
+ * machine-dependent state; a cached wait channel keeps its spinlock
+ * and its (empty) list of threads.
+ */
+static int thread_ctor(void *obj);
+static int wchan_ctor(void *obj);
+
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", struct thread, thread_ctor, NULL);
+static struct objcache wchan_cache =
+	OBJCACHE_INITIALIZER("wchan", struct wchan, wchan_ctor, NULL);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -72,6 +89,17 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduler parameters; see schedule(). A thread at level L gets a
+ * time slice of SCHED_QUANTUM(L) hardclocks, and moves up a level
+ * after waiting SCHED_AGE_HARDCLOCKS on a run queue.
+ */
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_AGE_HARDCLOCKS	50
+
+/* Set once gettime() works, to time dispatch latency. */
+static bool sched_timing = false;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +139,139 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Per-cpu kernel stack pools.
+ *
+ * When a zombie is reaped its stack goes into its cpu's pool, and
+ * thread_fork takes one from there before going to kmalloc. A pooled
+ * stack still has the guard words from thread_checkstack_init (they
+ * are checked on the way in), so it is ready to use as it is.
+ *
+ * A cpu keeps at most c_stackpool_target stacks, and exorcise retunes
+ * that every STACKPOOL_INTERVAL hardclocks to the forking it saw:
+ * each fork that found the pool empty adds one, and if the pool never
+ * fell below some level, half of that level was not needed and goes.
+ */
+static
+void *
+stackpool_get(void)
+{
+	struct cpu *c;
+	void *stack;
+	int spl;
+
+	stack = NULL;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nstacks > 0) {
+		stack = c->c_stacks[--c->c_nstacks];
+		if (c->c_nstacks < c->c_stackpool_low) {
+			c->c_stackpool_low = c->c_nstacks;
+		}
+		c->c_stackpool_hits++;
+	}
+	else {
+		c->c_stackpool_empty++;
+		c->c_stackpool_misses++;
+	}
+	splx(spl);
+	return stack;
+}
+
+/*
+ * Put THREAD's stack in this cpu's pool, if there's room; returns
+ * false (leaving the stack to the caller) if not.
+ */
+static
+bool
+stackpool_put(struct thread *thread)
+{
+	struct cpu *c;
+	bool ret;
+	int spl;
+
+	thread_checkstack(thread);
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	ret = c->c_nstacks < c->c_stackpool_target;
+	if (ret) {
+		c->c_stacks[c->c_nstacks++] = thread->t_stack;
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Retune this cpu's pool size if an interval has passed, and free
+ * any stacks beyond it. Called with interrupts off.
+ */
+static
+void
+stackpool_adapt(void)
+{
+	struct cpu *c;
+	unsigned target;
+
+	c = curcpu->c_self;
+	if (c->c_hardclocks - c->c_stackpool_epoch < STACKPOOL_INTERVAL) {
+		return;
+	}
+
+	target = c->c_stackpool_target;
+	if (c->c_stackpool_empty > 0) {
+		target += c->c_stackpool_empty;
+	}
+	else {
+		target -= (c->c_stackpool_low + 1) / 2;
+	}
+	if (target < STACKPOOL_MIN) {
+		target = STACKPOOL_MIN;
+	}
+	if (target > STACKPOOL_MAX) {
+		target = STACKPOOL_MAX;
+	}
+	c->c_stackpool_target = target;
+
+	while (c->c_nstacks > target) {
+		kfree(c->c_stacks[--c->c_nstacks]);
+	}
+
+	c->c_stackpool_epoch = c->c_hardclocks;
+	c->c_stackpool_empty = 0;
+	c->c_stackpool_low = c->c_nstacks;
+}
+
+void
+thread_stackpool_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, n;
+
+	n = cpu_numcpus();
+	for (i=0; i<n; i++) {
+		c = cpu_getcpu(i);
+		kprintf("cpu%u: stack pool %u/%u stacks, %u hits, "
+			"%u misses\n", i, c->c_nstacks,
+			c->c_stackpool_target, c->c_stackpool_hits,
+			c->c_stackpool_misses);
+	}
+}
+
+/*
+ * Construct a thread for thread_cache.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,22 +284,20 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_get(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		objcache_put(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* Thread subsystem fields (t_machdep, t_listnode: thread_ctor) */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -149,6 +308,12 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields: new threads start at the top */
+	thread->t_level = 0;
+	thread->t_ticks = 0;
+	thread->t_queuedat = 0;
+	thread->t_readytimed = false;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -167,6 +332,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i, j;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -181,12 +347,49 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 
+	spinlock_init(&c->c_pagemag_lock);
+	c->c_pagemag_count = 0;
+	c->c_pagemag_hits = 0;
+	c->c_pagemag_misses = 0;
+
+	for (i = 0; i < KMCACHE_NSIZES; i++) {
+		c->c_kmcache_count[i] = 0;
+	}
+	c->c_kmcache_hits = 0;
+	c->c_kmcache_misses = 0;
+
+	c->c_nstacks = 0;
+	c->c_stackpool_target = STACKPOOL_INIT;
+	c->c_stackpool_low = 0;
+	c->c_stackpool_empty = 0;
+	c->c_stackpool_epoch = 0;
+	c->c_stackpool_hits = 0;
+	c->c_stackpool_misses = 0;
+
+	c->c_asid_last = ASID_FIRST;
+	c->c_asid = 0;
+	c->c_lastas = NULL;
+
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i = 0; i < SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+		c->c_sched_latmax[i] = 0;
+		c->c_sched_latsum[i] = 0;
+		for (j = 0; j < SCHED_LATBUCKETS; j++) {
+			c->c_sched_lat[i][j] = 0;
+		}
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_sched_demotions = 0;
+	c->c_sched_preemptions = 0;
+	c->c_sched_aged = 0;
+	c->c_sched_boosts = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_posted = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -249,9 +452,10 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
+	if (thread->t_stack != NULL && !stackpool_put(thread)) {
 		kfree(thread->t_stack);
 	}
+	/* these check the state thread_ctor left them in */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,14 +463,17 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_put(&thread_cache, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu. All of them are reaped at once,
+ * their stacks going to this cpu's stack pool for the next forks;
+ * this is also where the pool gets resized. Called with interrupts
+ * off.
  */
 static
 void
@@ -279,6 +486,7 @@ exorcise(void)
 		KASSERT(z->t_state == S_ZOMBIE);
 		thread_destroy(z);
 	}
+	stackpool_adapt();
 }
 
 /*
@@ -289,6 +497,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +513,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i = 0; i < SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -406,6 +619,23 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Accessors for the cpu array. The array does not change once the
+ * secondary cpus are up, so no locking is needed.
+ */
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_getcpu(unsigned software_number)
+{
+	KASSERT(software_number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -424,6 +654,115 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	/* The clock is attached by now, so dispatches can be timed. */
+	sched_timing = true;
+}
+
+/*
+ * Run queues. Each cpu has one list per level; a thread goes on the
+ * list for its t_level, and the scheduler takes from the highest
+ * level that has anything. Called with the cpu's runqueue lock.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_level < SCHED_NLEVELS);
+
+	t->t_queuedat = c->c_hardclocks;
+	threadlist_addtail(&c->c_runqueue[t->t_level], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i = 0; i < SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last. */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i = SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* True if anything above LEVEL is waiting to run. */
+static
+bool
+runqueue_hasabove(struct cpu *c, unsigned level)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i = 0; i < level; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Record how long T waited between becoming runnable and being picked
+ * to run on C, at the level it was picked from. Called with C's
+ * runqueue lock.
+ */
+static
+void
+sched_account(struct cpu *c, struct thread *t)
+{
+	time_t secs;
+	uint32_t nsecs, usecs;
+	unsigned b;
+
+	if (!t->t_readytimed) {
+		return;
+	}
+	t->t_readytimed = false;
+
+	gettime(&secs, &nsecs);
+	getinterval(t->t_readysecs, t->t_readynsecs, secs, nsecs,
+		    &secs, &nsecs);
+	usecs = secs * 1000000 + nsecs / 1000;
+
+	for (b = 0; b < SCHED_LATBUCKETS - 1 && (usecs >> b) > 1; b++) {
+		/* find the power-of-two bucket */
+	}
+	c->c_sched_lat[t->t_level][b]++;
+	c->c_sched_latsum[t->t_level] += usecs;
+	if (usecs > c->c_sched_latmax[t->t_level]) {
+		c->c_sched_latmax[t->t_level] = usecs;
+	}
 }
 
 /*
@@ -449,8 +788,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	if (sched_timing) {
+		gettime(&target->t_readysecs, &target->t_readynsecs);
+		target->t_readytimed = true;
+	}
+
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -492,13 +836,16 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Get a stack, recycled if we can */
+	newthread->t_stack = stackpool_get();
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -574,7 +921,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -632,14 +979,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* use the time for VM housekeeping if there is any */
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	sched_account(curcpu->c_self, next);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -817,22 +1168,166 @@ thread_yield(void)
 	thread_switch(S_READY, NULL);
 }
 
+/*
+ * Called from hardclock() instead of thread_yield(): yield only when
+ * the current thread has used up its time slice, or something at a
+ * higher level is waiting to run.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur;
+	struct cpu *c;
+	bool yield;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	cur = curthread;
+	if (c->c_isidle) {
+		splx(spl);
+		return;
+	}
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_level)) {
+		/* used its whole slice: round-robin, one level down */
+		cur->t_ticks = 0;
+		if (cur->t_level < SCHED_NLEVELS - 1) {
+			cur->t_level++;
+			c->c_sched_demotions++;
+		}
+		yield = true;
+	}
+	else {
+		yield = runqueue_hasabove(c, cur->t_level);
+		if (yield) {
+			c->c_sched_preemptions++;
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+	splx(spl);
+
+	if (yield) {
+		thread_yield();
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues and always runs from the highest one with a thread on
+ * it, round-robin within a level.
+ *
+ *    - New threads start at level 0.
+ *    - A thread that uses its whole time slice (thread_timeslice)
+ *      drops a level; slices double at each level down, so CPU-bound
+ *      threads sink and run in longer, rarer stretches.
+ *    - A thread woken up from a wait channel moves up a level and
+ *      starts a fresh slice, so threads that mostly block (the shell,
+ *      console readers) stay near the top.
+ *    - A thread that becomes runnable above the running one's level
+ *      preempts it at the next hardclock.
+ *
+ * schedule() is called periodically from hardclock() to do aging:
+ * anything that has waited SCHED_AGE_HARDCLOCKS on a lower run queue
+ * moves up a level, so nothing starves however busy the upper levels
+ * are.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct cpu *c;
+	struct thread *t;
+	unsigned level, n, i;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (level = 1; level < SCHED_NLEVELS; level++) {
+		n = c->c_runqueue[level].tl_count;
+		for (i = 0; i < n; i++) {
+			t = threadlist_remhead(&c->c_runqueue[level]);
+			if (c->c_hardclocks - t->t_queuedat >=
+			    SCHED_AGE_HARDCLOCKS) {
+				t->t_level = level - 1;
+				t->t_ticks = 0;
+				t->t_queuedat = c->c_hardclocks;
+				c->c_sched_aged++;
+			}
+			threadlist_addtail(&c->c_runqueue[t->t_level], t);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Give a thread that is being woken up a boost: one level up and a
+ * fresh time slice.
+ */
+static
+void
+sched_wakeup(struct thread *t)
+{
+	int spl;
+
+	t->t_ticks = 0;
+	if (t->t_level > 0) {
+		t->t_level--;
+		spl = splhigh();
+		curcpu->c_self->c_sched_boosts++;
+		splx(spl);
+	}
+}
+
+/*
+ * Print each cpu's scheduler counters and, per level, how long
+ * threads waited between becoming runnable and running.
+ */
+void
+thread_sched_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, n, level, b;
+	uint64_t total, count;
+
+	n = cpu_numcpus();
+	for (i = 0; i < n; i++) {
+		c = cpu_getcpu(i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u: %u runnable; %u demotions, %u preemptions, "
+			"%u aged, %u boosts\n", i, c->c_runcount,
+			c->c_sched_demotions, c->c_sched_preemptions,
+			c->c_sched_aged, c->c_sched_boosts);
+		for (level = 0; level < SCHED_NLEVELS; level++) {
+			total = 0;
+			for (b = 0; b < SCHED_LATBUCKETS; b++) {
+				total += c->c_sched_lat[level][b];
+			}
+			if (total == 0) {
+				continue;
+			}
+			/* first bucket that takes in 99% of dispatches */
+			count = 0;
+			for (b = 0; b < SCHED_LATBUCKETS - 1; b++) {
+				count += c->c_sched_lat[level][b];
+				if (count * 100 >= total * 99) {
+					break;
+				}
+			}
+			kprintf("  level %u: %u dispatches, latency mean %u "
+				"usec, p99 < %u%s usec, max %u usec\n",
+				level, (unsigned)total,
+				(unsigned)(c->c_sched_latsum[level] / total),
+				2U << b, b == SCHED_LATBUCKETS - 1 ? "+" : "",
+				(unsigned)c->c_sched_latmax[level]);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
 }
 
 /*
@@ -866,9 +1361,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runcount;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runcount;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -882,7 +1377,7 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(curcpu->c_self);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -893,7 +1388,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (c->c_runcount < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -924,7 +1419,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -948,7 +1443,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -971,31 +1466,51 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_get(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The corresponding cleanup functions require this, and it is the
+ * state the cache keeps it in.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	objcache_put(&wchan_cache, wc);
+}
+
+/*
+ * Change the name of a wait channel, for objects that keep theirs
+ * when they are cached and reused under another name.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1050,6 +1565,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	sched_wakeup(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1600,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		sched_wakeup(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1140,26 +1657,63 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already going to flush everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+	ticket = ++target->c_shootdown_posted;
+
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	mainbus_send_ipi(target);
+
+	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+unsigned
+ipi_tlbshootdown_all(struct cpu *target)
+{
+	unsigned ticket;
+
+	spinlock_acquire(&target->c_ipi_lock);
+
+	target->c_numshootdown = TLBSHOOTDOWN_ALL;
+	ticket = ++target->c_shootdown_posted;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	KASSERT(target != curcpu->c_self);
+	KASSERT(curthread->t_curspl == 0);
+
+	/* (wraparound-safe comparison) */
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		/* spin; the target takes the IPI as soon as it can */
+	}
 }
 
 void
@@ -1202,6 +1756,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_posted;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -30,7 +30,14 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include "opt-kmprof.h"
+#if OPT_KMPROF
+#include <kmprof.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -71,9 +78,28 @@ fill_deadbeef(void *vptr, size_t len)
 //    sizes, and large numbers of items of the new size are allocated.
 //
 //    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    pageref structures. These cannot recursively use the subpage
+//    allocator, so they come a page at a time from alloc_kpages and
+//    are handed out from a free list.
+//
+//    Sizes above LARGEST_SUBPAGE_SIZE don't fit on one page, so their
+//    blocks are carved from a "slab" of a few contiguous pages (still
+//    under one pageref), sized so the blocks fill it exactly. Anything
+//    bigger than the largest size, or that would waste more in a slab
+//    than in whole pages, gets whole pages of its own, with a pageref
+//    recording how many.
+//
+//    Pages that have free blocks are kept on a list per block size, so
+//    an allocation takes the first page on its list. Every page of the
+//    heap is entered by physical page number in pageinfo[], so a free
+//    finds the pageref a block belongs to with one lookup.
+//
+//    In front of all that, each cpu keeps a few free blocks of each
+//    of the subpage sizes (c_kmcache, in struct cpu), and most
+//    allocations and frees are served from there without taking the
+//    lock. An empty cache is refilled, and a full one drained,
+//    KMCACHE_BATCH blocks at a time. Blocks in a cpu's cache are
+//    still allocated as far as their pages are concerned.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -83,11 +109,29 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NSIZES 13
+static const size_t sizes[NSIZES] = {
+	16, 32, 64, 128, 256, 512, 1024, 2048,
+	3072, 5120, 6144, 10240, 14336
+};
+/* pages per slab for each size; no slab has space left over */
+static const unsigned slabpages[NSIZES] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	3, 5, 3, 5, 7
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SLAB_SIZE 14336
+
+/* the per-cpu caches cover just the subpage sizes, 16 to 2048 */
+#if KMCACHE_NSIZES != 8
+#error "KMCACHE_NSIZES in <machine/vm.h> doesn't match the subpage sizes"
+#endif
+
+#if OPT_KMPROF && KMPROF_NCLASSES != NSIZES + 1
+#error "KMPROF_NCLASSES in <kmprof.h> doesn't match NSIZES"
+#endif
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -102,101 +146,238 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
-	vaddr_t pageaddr_and_blocktype;
+	struct pageref *next_samesize;	/* pages of this size with free */
+	struct pageref *prev_samesize;	/* blocks (sizebases[]), or the
+					   pageref free list */
+	vaddr_t pageaddr_and_blocktype;	/* 0 if the pageref is free */
 	uint16_t freelist_offset;
-	uint16_t nfree;
+	uint16_t nfree;			/* page count, for LARGE_BLOCKTYPE */
 };
 
 #define INVALID_OFFSET   (0xffff)
 
+/* Block type of a whole-page allocation. */
+#define LARGE_BLOCKTYPE  NSIZES
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Bytes in a slab of BLKTYPE, and the number of blocks it holds. */
+#define SLABSIZE(blk)    (slabpages[blk] * PAGE_SIZE)
+#define SLABBLOCKS(blk)  (SLABSIZE(blk) / sizes[blk])
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs come a page at a time. The first page is in the BSS so
+ * that kmalloc works before alloc_kpages does; more are added with
+ * alloc_kpages as the heap grows, and never given back (a pageref
+ * costs 16 bytes per page or slab of heap). Free pagerefs are kept
+ * on a list, through next_samesize.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFS_PER_PAGE \
+	((PAGE_SIZE - sizeof(void *)) / sizeof(struct pageref))
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	struct pageref refs[PAGEREFS_PER_PAGE];
+};
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pagerefpage pagerefs_first;
+static struct pagerefpage *pagerefpages;
+static struct pageref *pagerefs_free;
+static unsigned pagerefs_total, pagerefs_used;
+
+/* Add the pagerefs in PP to the pool. */
+static
+void
+pagerefpage_add(struct pagerefpage *pp)
+{
+	unsigned i;
+
+	pp->next = pagerefpages;
+	pagerefpages = pp;
+	for (i=0; i<PAGEREFS_PER_PAGE; i++) {
+		pp->refs[i].pageaddr_and_blocktype = 0;
+		pp->refs[i].next_samesize = pagerefs_free;
+		pagerefs_free = &pp->refs[i];
+	}
+	pagerefs_total += PAGEREFS_PER_PAGE;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (pagerefpages == NULL) {
+		pagerefpage_add(&pagerefs_first);
 	}
 
-	/* ran out */
-	return NULL;
+	pr = pagerefs_free;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	pagerefs_free = pr->next_samesize;
+	pr->next_samesize = pr->prev_samesize = NULL;
+	pagerefs_used++;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(p->pageaddr_and_blocktype != 0);
+	p->pageaddr_and_blocktype = 0;
+	p->next_samesize = pagerefs_free;
+	pagerefs_free = p;
+	KASSERT(pagerefs_used > 0);
+	pagerefs_used--;
+}
+
+////////////////////////////////////////
+
+/*
+ * The pageref, if any, for each physical page. Every page of a slab
+ * points at the slab's pageref; only the first page of a whole-page
+ * allocation does. The table comes in page-sized chunks, allocated
+ * as the heap reaches the memory they cover and never freed.
+ *
+ * Entries are only changed under kmalloc_spinlock, when a page joins
+ * or leaves the heap. While a block is allocated its page can't
+ * leave, so kfree can look up the page of the block it is given
+ * without the lock.
+ */
+#define PAGEINFO_CHUNK   (PAGE_SIZE / sizeof(struct pageref *))
+#define PAGEINFO_NCHUNKS \
+	((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE / PAGEINFO_CHUNK)
+
+static struct pageref **pageinfo[PAGEINFO_NCHUNKS];
+
+static
+struct pageref *
+pageinfo_lookup(vaddr_t addr)
+{
+	struct pageref **chunk;
+	unsigned pn;
+
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	pn = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	chunk = pageinfo[pn / PAGEINFO_CHUNK];
+	if (chunk == NULL) {
+		return NULL;
+	}
+	return chunk[pn % PAGEINFO_CHUNK];
+}
+
+/* The chunks for the NPAGES pages at ADDR must exist. */
+static
+void
+pageinfo_set(vaddr_t addr, unsigned npages, struct pageref *pr)
+{
+	unsigned pn, i;
+
+	pn = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	for (i=0; i<npages; i++, pn++) {
+		KASSERT(pageinfo[pn / PAGEINFO_CHUNK] != NULL);
+		pageinfo[pn / PAGEINFO_CHUNK][pn % PAGEINFO_CHUNK] = pr;
+	}
 }
 
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock covers the pages and their pagerefs. The per-cpu
+ * caches only take it to refill or drain in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/* Pages in whole-page allocations, for kheap_printstats. */
+static unsigned kmalloc_largepages;
+
+/*
+ * Get a pageref, adding a page of them to the pool if it is empty.
+ * Called with kmalloc_spinlock, which is dropped around alloc_kpages;
+ * returns NULL if out of memory.
+ */
+static
+struct pageref *
+getpageref(void)
+{
+	struct pagerefpage *pp;
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	while ((pr = allocpageref()) == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		pp = (struct pagerefpage *)alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (pp == NULL) {
+			/* somebody may have freed one meanwhile */
+			return allocpageref();
+		}
+		pagerefpage_add(pp);
+	}
+	return pr;
+}
+
+/*
+ * Make sure pageinfo[] covers the NPAGES pages at ADDR. Called
+ * without kmalloc_spinlock; returns false if out of memory.
+ */
+static
+bool
+pageinfo_cover(vaddr_t addr, unsigned npages)
+{
+	struct pageref **chunk;
+	unsigned c, first, last;
+
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	first = (addr - MIPS_KSEG0) / PAGE_SIZE / PAGEINFO_CHUNK;
+	last = (addr - MIPS_KSEG0) / PAGE_SIZE + npages - 1;
+	last /= PAGEINFO_CHUNK;
+
+	for (c = first; c <= last; c++) {
+		/* chunks are never freed, so this test is safe unlocked */
+		if (pageinfo[c] != NULL) {
+			continue;
+		}
+		chunk = (struct pageref **)alloc_kpages(1);
+		if (chunk == NULL) {
+			kprintf("kmalloc: couldn't get a page for "
+				"pageinfo\n");
+			return false;
+		}
+		bzero(chunk, PAGE_SIZE);
+
+		spinlock_acquire(&kmalloc_spinlock);
+		if (pageinfo[c] == NULL) {
+			pageinfo[c] = chunk;
+			chunk = NULL;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (chunk != NULL) {
+			/* somebody else got it in first */
+			free_kpages((vaddr_t)chunk);
+		}
+	}
+	return true;
+}
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -226,15 +407,17 @@ checksubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(blktype < NSIZES);
+	KASSERT(pr->freelist_offset < SLABSIZE(blktype));
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
+	KASSERT(pageinfo_lookup(prpage) == pr);
 
 	fla = prpage + pr->freelist_offset;
 	fl = (struct freelist *)fla;
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + SLABSIZE(blktype));
 		KASSERT((fla-prpage) % sizes[blktype] == 0);
 		KASSERT(fla >= MIPS_KSEG0);
 		KASSERT(fla < MIPS_KSEG1);
@@ -251,27 +434,42 @@ static
 void
 checksubpages(void)
 {
+	struct pagerefpage *pp;
 	struct pageref *pr;
 	int i;
-	unsigned sc=0, ac=0;
+	unsigned j, sc=0, ac=0, used=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(sc < pagerefs_used);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	/* every page with a free block is on its list */
+	for (pp = pagerefpages; pp != NULL; pp = pp->next) {
+		for (j=0; j<PAGEREFS_PER_PAGE; j++) {
+			pr = &pp->refs[j];
+			if (pr->pageaddr_and_blocktype == 0) {
+				continue;
+			}
+			used++;
+			if (PR_BLOCKTYPE(pr) == LARGE_BLOCKTYPE) {
+				continue;
+			}
+			checksubpage(pr);
+			if (pr->nfree > 0) {
+				ac++;
+			}
+		}
 	}
 
 	KASSERT(sc==ac);
+	KASSERT(used==pagerefs_used);
 }
 #else
 #define checksubpages() 
@@ -289,7 +487,6 @@ dumpsubpage(struct pageref *pr)
 	unsigned i, n, index;
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
-	checksubpage(pr);
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	/* clear freemap[] */
@@ -300,8 +497,14 @@ dumpsubpage(struct pageref *pr)
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
 
+	if (blktype == LARGE_BLOCKTYPE) {
+		kprintf("at 0x%08lx: %u pages\n", (unsigned long)prpage,
+			(unsigned) pr->nfree);
+		return;
+	}
+
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = SLABBLOCKS(blktype);
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -316,7 +519,8 @@ dumpsubpage(struct pageref *pr)
 		}
 	}
 
-	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n", 
+	checksubpage(pr);
+	kprintf("at 0x%08lx: size %-5lu  %u/%u free\n", 
 		(unsigned long)prpage, (unsigned long) sizes[blktype],
 		(unsigned) pr->nfree, n);
 	kprintf("   ");
@@ -333,45 +537,76 @@ dumpsubpage(struct pageref *pr)
 void
 kheap_printstats(void)
 {
-	struct pageref *pr;
+	struct pagerefpage *pp;
+	struct cpu *c;
+	unsigned i, j, n, cached;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (pp = pagerefpages; pp != NULL; pp = pp->next) {
+		for (j=0; j<PAGEREFS_PER_PAGE; j++) {
+			if (pp->refs[j].pageaddr_and_blocktype != 0) {
+				dumpsubpage(&pp->refs[j]);
+			}
+		}
 	}
+	kprintf("pagerefs: %u of %u in use; %u pages in large "
+		"allocations\n", pagerefs_used, pagerefs_total,
+		kmalloc_largepages);
 
 	spinlock_release(&kmalloc_spinlock);
+
+	/* blocks in these caches show as allocated above */
+	n = cpu_numcpus();
+	for (i=0; i<n; i++) {
+		c = cpu_getcpu(i);
+		cached = 0;
+		for (j=0; j<KMCACHE_NSIZES; j++) {
+			cached += c->c_kmcache_count[j];
+		}
+		kprintf("cpu%u: kmalloc cache %u blocks, %u hits, "
+			"%u misses\n", i, cached, c->c_kmcache_hits,
+			c->c_kmcache_misses);
+	}
 }
 
 ////////////////////////////////////////
 
+/* Put PR on the list of pages of its size that have free blocks. */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+sizebase_insert(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
 	}
+	sizebases[blktype] = pr;
+}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+static
+void
+sizebase_remove(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
 	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
 }
 
 static
@@ -392,62 +627,123 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block from page PR, which must have one. Called with
+ * kmalloc_spinlock.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_take(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	checksubpage(pr);
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < SLABSIZE(PR_BLOCKTYPE(pr)));
 
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < SLABSIZE(PR_BLOCKTYPE(pr)));
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		/* full now */
+		sizebase_remove(pr, PR_BLOCKTYPE(pr));
+	}
 
-	checksubpages();
+	return retptr;
+}
+
+/*
+ * Give the block at PTR back to its page (or slab) PR. If that leaves
+ * it entirely free, it leaves the heap, and its address is returned
+ * for the caller to free_kpages once it has dropped kmalloc_spinlock;
+ * otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_put(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	checksubpage(pr);
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
 
-		if (pr->nfree > 0) {
+	fl = ptr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+		/* not full any more */
+		sizebase_insert(pr, blktype);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
 
-		doalloc: /* comes here after getting a whole fresh page */
+	KASSERT(pr->nfree <= SLABBLOCKS(blktype));
+	if (pr->nfree == SLABBLOCKS(blktype)) {
+		/* Whole page (or slab) is free. */
+		sizebase_remove(pr, blktype);
+		pageinfo_set(prpage, slabpages[blktype], NULL);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+/*
+ * Get a block of size sizes[BLKTYPE] from a page that has one, or
+ * from a fresh page (or slab) if none does.
+ */
+static
+void *
+subpage_kmalloc(int blktype)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	unsigned npages;	// slabpages[blktype]
+	void *retptr;		// our result
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	volatile int i;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	spinlock_acquire(&kmalloc_spinlock);
 
-			checksubpages();
+	checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+	if (sizebases[blktype] != NULL) {
+		retptr = subpage_take(sizebases[blktype]);
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -460,15 +756,27 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	npages = slabpages[blktype];
+	prpage = alloc_kpages(npages);
 	if (prpage==0) {
-		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
+		/*
+		 * Out of memory. Not worth a message for a slab: kmalloc
+		 * falls back to whole pages, which may still be there.
+		 */
+		if (blktype < KMCACHE_NSIZES) {
+			kprintf("kmalloc: Subpage allocator couldn't get %u "
+				"page(s)\n", npages);
+		}
+		return NULL;
+	}
+	if (!pageinfo_cover(prpage, npages)) {
+		free_kpages(prpage);
 		return NULL;
 	}
+
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
+	pr = getpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -478,7 +786,7 @@ subpage_kmalloc(size_t sz)
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = SLABBLOCKS(blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,101 +806,155 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	pageinfo_set(prpage, npages, pr);
+	sizebase_insert(pr, blktype);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	retptr = subpage_take(pr);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	return retptr;
 }
 
+/*
+ * Allocate whole pages for SZ bytes, and record how many in a pageref
+ * so kfree knows the allocation is ours and how big it is.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void *
+large_kmalloc(size_t sz)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	struct pageref *pr;
+	unsigned long npages;
+	vaddr_t address;
+
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	KASSERT(npages <= 0xffff);
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
+	}
+	if (!pageinfo_cover(address, 1)) {
+		free_kpages(address);
+		return NULL;
+	}
 
 	spinlock_acquire(&kmalloc_spinlock);
+	pr = getpageref();
+	if (pr == NULL) {
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(address);
+		kprintf("kmalloc: couldn't get pageref for %lu pages\n",
+			npages);
+		return NULL;
+	}
+	pr->pageaddr_and_blocktype = MKPAB(address, LARGE_BLOCKTYPE);
+	pr->freelist_offset = INVALID_OFFSET;
+	pr->nfree = npages;
+	pageinfo_set(address, 1, pr);
+	kmalloc_largepages += npages;
+	spinlock_release(&kmalloc_spinlock);
 
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	return (void *)address;
+}
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
+/*
+ * Take a block of size sizes[BLKTYPE] from this cpu's cache, first
+ * refilling the cache from pages that have free blocks if it is
+ * empty. Returns NULL if no page has one; the caller then goes to
+ * subpage_kmalloc for a fresh page.
+ */
+static
+void *
+kmcache_alloc(int blktype)
+{
+	struct cpu *c;
+	unsigned *count;
+	void *ptr;
+	int spl;
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	if (!CURCPU_EXISTS() || blktype >= KMCACHE_NSIZES) {
+		/* too early in boot, or not a cached size */
+		return NULL;
 	}
 
-	offset = ptraddr - prpage;
+	spl = splhigh();
+	c = curcpu->c_self;
+	count = &c->c_kmcache_count[blktype];
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	if (*count > 0) {
+		c->c_kmcache_hits++;
+	}
+	else {
+		c->c_kmcache_misses++;
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		while (*count < KMCACHE_BATCH && sizebases[blktype] != NULL) {
+			c->c_kmcache[blktype][(*count)++] =
+				subpage_take(sizebases[blktype]);
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		if (*count == 0) {
+			splx(spl);
+			return NULL;
+		}
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	ptr = c->c_kmcache[blktype][--(*count)];
+	splx(spl);
+	return ptr;
+}
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+/*
+ * Put the block at PTR, of size sizes[BLKTYPE], in this cpu's cache,
+ * first draining part of the cache back to the pages if it is full.
+ * Returns false if there is no cache to put it in yet.
+ */
+static
+bool
+kmcache_free(void *ptr, int blktype)
+{
+	struct cpu *c;
+	struct pageref *pr;
+	vaddr_t freepages[KMCACHE_BATCH];
+	unsigned *count, i, nfreepages;
+	void *block;
+	int spl;
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (!CURCPU_EXISTS() || blktype >= KMCACHE_NSIZES) {
+		return false;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
+	nfreepages = 0;
+	spl = splhigh();
+	c = curcpu->c_self;
+	count = &c->c_kmcache_count[blktype];
+
+	if (*count == KMCACHE_SIZE) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (i=0; i<KMCACHE_BATCH; i++) {
+			block = c->c_kmcache[blktype][--(*count)];
+			pr = pageinfo_lookup((vaddr_t)block);
+			KASSERT(pr != NULL);
+			freepages[nfreepages] = subpage_put(pr, block);
+			if (freepages[nfreepages] != 0) {
+				nfreepages++;
+			}
+		}
+		checksubpages();
 		spinlock_release(&kmalloc_spinlock);
 	}
+	c->c_kmcache[blktype][(*count)++] = ptr;
+	splx(spl);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
-
-	return 0;
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
 }
 
 //
@@ -601,34 +963,106 @@ subpage_kfree(void *ptr)
 void *
 kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
+	void *ptr;
+	int blktype;
 
-		return (void *)address;
+	if (sz > LARGEST_SUBPAGE_SIZE &&
+	    (sz > LARGEST_SLAB_SIZE ||
+	     sizes[blocktype(sz)] >= ROUNDUP(sz, PAGE_SIZE))) {
+		/* whole pages are tighter than a slab */
+		blktype = LARGE_BLOCKTYPE;
+		ptr = large_kmalloc(sz);
+	}
+	else {
+		blktype = blocktype(sz);
+		ptr = kmcache_alloc(blktype);
+		if (ptr == NULL) {
+			ptr = subpage_kmalloc(blktype);
+		}
+		if (ptr == NULL && blktype >= KMCACHE_NSIZES) {
+			/* couldn't get a slab's worth of contiguous pages */
+			blktype = LARGE_BLOCKTYPE;
+			ptr = large_kmalloc(sz);
+		}
 	}
 
-	return subpage_kmalloc(sz);
+#if OPT_KMPROF
+	if (ptr != NULL) {
+		kmprof_alloc((vaddr_t)__builtin_return_address(0), ptr, sz,
+			     blktype == LARGE_BLOCKTYPE ?
+			     ROUNDUP(sz, PAGE_SIZE) : sizes[blktype],
+			     blktype);
+	}
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage, offset;
+	int blktype;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+#if OPT_KMPROF
+	kmprof_free(ptr);
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+	pr = pageinfo_lookup(ptraddr);
+	if (pr == NULL) {
+		/* Not on any of our pages - not from kmalloc */
+		KASSERT(ptraddr%PAGE_SIZE==0);
+		free_kpages(ptraddr);
+		return;
+	}
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	if (blktype == LARGE_BLOCKTYPE) {
+		if (ptraddr != prpage) {
+			panic("kfree: free of invalid addr %p inside a "
+			      "%u-page allocation\n", ptr,
+			      (unsigned)pr->nfree);
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		kmalloc_largepages -= pr->nfree;
+		pageinfo_set(prpage, 1, NULL);
+		freepageref(pr);
+		spinlock_release(&kmalloc_spinlock);
+		free_kpages(prpage);
+		return;
+	}
+
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	offset = ptraddr - prpage;
+
+	/* Check for proper positioning and alignment */
+	if (offset >= SLABSIZE(blktype) || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
 	 */
-	if (ptr == NULL) {
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (kmcache_free(ptr, blktype)) {
 		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
 	}
-}
 
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	prpage = subpage_put(pr, ptr);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
+		free_kpages(prpage);
+	}
+}
@@ -0,0 +1,373 @@
+/*
+ * kmalloc call-site profiler; see kmprof.h.
+ *
+ * Live blocks are kept in an open-addressed hash table keyed by
+ * address, so kfree can find the site a block was charged to. The
+ * table is allocated with alloc_kpages by kmprof_bootstrap (it can't
+ * come from kmalloc, and allocating it from inside kmalloc would put
+ * a large multi-page allocation on some unlucky caller's path).
+ * Allocations made before that are not tracked. The table never
+ * grows: allocations made while it is too full are counted as
+ * dropped and not tracked. Call sites are in a
+ * second, smaller table; once that fills, new sites share slot 0.
+ *
+ * Everything is under one spinlock. Each kmalloc and kfree costs a
+ * hash probe or two under it, which is cheap next to the allocation.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <vm.h>
+#include <kmprof.h>
+
+#define KMPROF_BLOCKBITS 13
+#define KMPROF_NBLOCKS   (1 << KMPROF_BLOCKBITS)
+#define KMPROF_MAXBLOCKS (KMPROF_NBLOCKS / 4 * 3)	/* max load */
+#define KMPROF_SITEBITS  9
+#define KMPROF_NSITES    (1 << KMPROF_SITEBITS)
+#define KMPROF_TOP       10
+
+struct kmprof_block {
+	vaddr_t kb_addr;		/* 0 if the slot is empty */
+	uint32_t kb_size;		/* bytes requested */
+	uint16_t kb_site;		/* index into kmprof_sites[] */
+	uint16_t kb_class;		/* size class */
+};
+
+struct kmprof_site {
+	vaddr_t ks_caller;		/* 0 if unused (or for slot 0) */
+	unsigned ks_live;		/* blocks not yet freed */
+	unsigned ks_livebytes;		/* bytes requested in them */
+	unsigned ks_allocs;		/* allocations ever */
+	unsigned ks_lastallocs;		/* ks_allocs at the last report */
+};
+
+struct kmprof_class {
+	unsigned kc_blksize;		/* block size (largest, for pages) */
+	unsigned kc_live;		/* blocks not yet freed */
+	unsigned kc_reqbytes;		/* bytes requested in them */
+	unsigned kc_blockbytes;		/* bytes of block in them */
+	unsigned kc_allocs;		/* allocations ever */
+};
+
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+static struct kmprof_block *kmprof_blocks;
+static unsigned kmprof_nblocks;
+static struct kmprof_site kmprof_sites[KMPROF_NSITES];
+static struct kmprof_class kmprof_classes[KMPROF_NCLASSES];
+static unsigned kmprof_dropped, kmprof_untracked;
+static time_t kmprof_lastsecs;
+static uint32_t kmprof_lastnsecs;
+
+static
+unsigned
+kmprof_hash(vaddr_t addr, unsigned bits)
+{
+	/* blocks are at least 16-byte aligned */
+	return ((uint32_t)(addr >> 4) * 2654435761U) >> (32 - bits);
+}
+
+/*
+ * Allocate the block table and start the first interval. Called once,
+ * before the other cpus are started, so kmprof_blocks can be checked
+ * without the lock afterwards. Without memory for the table the
+ * profiler stays off.
+ */
+void
+kmprof_bootstrap(void)
+{
+	struct kmprof_block *blocks;
+	unsigned npages;
+	time_t secs;
+	uint32_t nsecs;
+
+	npages = DIVROUNDUP(KMPROF_NBLOCKS * sizeof(struct kmprof_block),
+			    PAGE_SIZE);
+	blocks = (struct kmprof_block *)alloc_kpages(npages);
+	if (blocks == NULL) {
+		kprintf("kmprof: no memory for the block table; "
+			"profiling is off\n");
+		return;
+	}
+	bzero(blocks, npages * PAGE_SIZE);
+
+	gettime(&secs, &nsecs);
+	spinlock_acquire(&kmprof_lock);
+	kmprof_lastsecs = secs;
+	kmprof_lastnsecs = nsecs;
+	kmprof_blocks = blocks;
+	spinlock_release(&kmprof_lock);
+}
+
+/* Find (or add) the site for CALLER. Called with kmprof_lock. */
+static
+unsigned
+kmprof_site(vaddr_t caller)
+{
+	unsigned i, n;
+
+	i = kmprof_hash(caller, KMPROF_SITEBITS);
+	for (n = 0; n < KMPROF_NSITES; n++) {
+		if (i != 0 && kmprof_sites[i].ks_caller == caller) {
+			return i;
+		}
+		if (i != 0 && kmprof_sites[i].ks_caller == 0) {
+			kmprof_sites[i].ks_caller = caller;
+			return i;
+		}
+		i = (i + 1) & (KMPROF_NSITES - 1);
+	}
+	/* full up */
+	return 0;
+}
+
+void
+kmprof_alloc(vaddr_t caller, void *ptr, size_t reqsize, size_t blksize,
+	     unsigned sizeclass)
+{
+	struct kmprof_class *kc;
+	struct kmprof_site *ks;
+	unsigned i;
+
+	KASSERT(sizeclass < KMPROF_NCLASSES);
+
+	if (kmprof_blocks == NULL) {
+		/* not started, or no table */
+		return;
+	}
+
+	spinlock_acquire(&kmprof_lock);
+
+	ks = &kmprof_sites[kmprof_site(caller)];
+	ks->ks_allocs++;
+	kc = &kmprof_classes[sizeclass];
+	kc->kc_allocs++;
+	if (blksize > kc->kc_blksize) {
+		kc->kc_blksize = blksize;
+	}
+
+	if (kmprof_nblocks >= KMPROF_MAXBLOCKS) {
+		/* can't track it, so don't count it as live either */
+		kmprof_dropped++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+
+	i = kmprof_hash((vaddr_t)ptr, KMPROF_BLOCKBITS);
+	while (kmprof_blocks[i].kb_addr != 0) {
+		KASSERT(kmprof_blocks[i].kb_addr != (vaddr_t)ptr);
+		i = (i + 1) & (KMPROF_NBLOCKS - 1);
+	}
+	kmprof_blocks[i].kb_addr = (vaddr_t)ptr;
+	kmprof_blocks[i].kb_size = reqsize;
+	kmprof_blocks[i].kb_site = ks - kmprof_sites;
+	kmprof_blocks[i].kb_class = sizeclass;
+	kmprof_nblocks++;
+
+	ks->ks_live++;
+	ks->ks_livebytes += reqsize;
+	kc->kc_live++;
+	kc->kc_reqbytes += reqsize;
+	kc->kc_blockbytes += blksize;
+
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_free(void *ptr)
+{
+	struct kmprof_block *kb;
+	struct kmprof_class *kc;
+	struct kmprof_site *ks;
+	unsigned i, j, k;
+
+	if (kmprof_blocks == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&kmprof_lock);
+
+	i = kmprof_hash((vaddr_t)ptr, KMPROF_BLOCKBITS);
+	while (kmprof_blocks[i].kb_addr != (vaddr_t)ptr) {
+		if (kmprof_blocks[i].kb_addr == 0) {
+			/* allocated before we started, or dropped */
+			kmprof_untracked++;
+			spinlock_release(&kmprof_lock);
+			return;
+		}
+		i = (i + 1) & (KMPROF_NBLOCKS - 1);
+	}
+
+	kb = &kmprof_blocks[i];
+	ks = &kmprof_sites[kb->kb_site];
+	kc = &kmprof_classes[kb->kb_class];
+	KASSERT(ks->ks_live > 0 && kc->kc_live > 0);
+	ks->ks_live--;
+	ks->ks_livebytes -= kb->kb_size;
+	kc->kc_live--;
+	kc->kc_reqbytes -= kb->kb_size;
+	/* whole-page blocks vary in size; recompute from the request */
+	kc->kc_blockbytes -= (kb->kb_class == KMPROF_NCLASSES - 1) ?
+		ROUNDUP(kb->kb_size, PAGE_SIZE) : kc->kc_blksize;
+
+	/* delete by shifting later entries of the run back into the gap */
+	j = i;
+	for (;;) {
+		j = (j + 1) & (KMPROF_NBLOCKS - 1);
+		if (kmprof_blocks[j].kb_addr == 0) {
+			break;
+		}
+		k = kmprof_hash(kmprof_blocks[j].kb_addr, KMPROF_BLOCKBITS);
+		/* can entry j live at i, i.e. is k outside (i, j]? */
+		if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			kmprof_blocks[i] = kmprof_blocks[j];
+			i = j;
+		}
+	}
+	kmprof_blocks[i].kb_addr = 0;
+	kmprof_nblocks--;
+
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * Fill TOP with the indexes of the (up to) KMPROF_TOP sites with the
+ * largest nonzero KEY, biggest first; returns how many there are.
+ */
+static
+unsigned
+kmprof_top(unsigned (*key)(const struct kmprof_site *), unsigned *top)
+{
+	unsigned i, j, n, v;
+
+	n = 0;
+	for (i = 0; i < KMPROF_NSITES; i++) {
+		v = key(&kmprof_sites[i]);
+		if (v == 0) {
+			continue;
+		}
+		for (j = n; j > 0 && key(&kmprof_sites[top[j-1]]) < v; j--) {
+			if (j < KMPROF_TOP) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < KMPROF_TOP) {
+			top[j] = i;
+			if (n < KMPROF_TOP) {
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+static
+unsigned
+kmprof_livebytes(const struct kmprof_site *ks)
+{
+	return ks->ks_livebytes;
+}
+
+static
+unsigned
+kmprof_recentallocs(const struct kmprof_site *ks)
+{
+	return ks->ks_allocs - ks->ks_lastallocs;
+}
+
+static
+void
+kmprof_printsite(const struct kmprof_site *ks, unsigned rate)
+{
+	if (ks == &kmprof_sites[0]) {
+		kprintf("  (other)   ");
+	}
+	else {
+		kprintf("  0x%08lx", (unsigned long)ks->ks_caller);
+	}
+	kprintf(" %9u %7u %10u %8u\n", ks->ks_livebytes, ks->ks_live,
+		ks->ks_allocs, rate);
+}
+
+void
+kmprof_printstats(void)
+{
+	struct kmprof_class *kc;
+	unsigned top[KMPROF_TOP];
+	unsigned i, n, ms, frag;
+	time_t secs;
+	uint32_t nsecs;
+
+	if (kmprof_blocks == NULL) {
+		kprintf("kmprof: not running\n");
+		return;
+	}
+
+	gettime(&secs, &nsecs);
+
+	spinlock_acquire(&kmprof_lock);
+
+	/* rates are over the time since the last report */
+	ms = (secs - kmprof_lastsecs) * 1000;
+	ms += nsecs / 1000000;
+	ms -= kmprof_lastnsecs / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	kprintf("kmalloc call sites by live bytes:\n");
+	kprintf("  %-10s %9s %7s %10s %8s\n", "caller", "bytes", "blocks",
+		"allocs", "allocs/s");
+	n = kmprof_top(kmprof_livebytes, top);
+	for (i = 0; i < n; i++) {
+		kmprof_printsite(&kmprof_sites[top[i]],
+			(uint64_t)kmprof_recentallocs(&kmprof_sites[top[i]])
+			* 1000 / ms);
+	}
+
+	kprintf("kmalloc call sites by allocations over the last %u ms:\n",
+		ms);
+	n = kmprof_top(kmprof_recentallocs, top);
+	for (i = 0; i < n; i++) {
+		kmprof_printsite(&kmprof_sites[top[i]],
+			(uint64_t)kmprof_recentallocs(&kmprof_sites[top[i]])
+			* 1000 / ms);
+	}
+
+	kprintf("Internal fragmentation by size class:\n");
+	kprintf("  %-6s %7s %10s %10s %5s %10s\n", "size", "blocks",
+		"requested", "allocated", "waste", "allocs");
+	for (i = 0; i < KMPROF_NCLASSES; i++) {
+		kc = &kmprof_classes[i];
+		if (kc->kc_allocs == 0) {
+			continue;
+		}
+		frag = kc->kc_blockbytes == 0 ? 0 :
+			(uint64_t)(kc->kc_blockbytes - kc->kc_reqbytes) * 100
+			/ kc->kc_blockbytes;
+		if (i == KMPROF_NCLASSES - 1) {
+			kprintf("  %-6s", "pages");
+		}
+		else {
+			kprintf("  %-6u", kc->kc_blksize);
+		}
+		kprintf(" %7u %10u %10u %4u%% %10u\n", kc->kc_live,
+			kc->kc_reqbytes, kc->kc_blockbytes, frag,
+			kc->kc_allocs);
+	}
+
+	kprintf("%u blocks tracked, %u allocations dropped, "
+		"%u untracked frees\n", kmprof_nblocks, kmprof_dropped,
+		kmprof_untracked);
+
+	/* start the next interval */
+	for (i = 0; i < KMPROF_NSITES; i++) {
+		kmprof_sites[i].ks_lastallocs = kmprof_sites[i].ks_allocs;
+	}
+	kmprof_lastsecs = secs;
+	kmprof_lastnsecs = nsecs;
+
+	spinlock_release(&kmprof_lock);
+}
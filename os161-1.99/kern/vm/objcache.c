@@ -0,0 +1,106 @@
+/*
+ * Typed object caches; see objcache.h.
+ *
+ * Each cache keeps a stack of up to OBJCACHE_DEPTH constructed
+ * objects under its own spinlock. Objects themselves come from
+ * kmalloc, whose per-cpu caches make the miss path cheap too.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <objcache.h>
+
+/* Every cache that has been used, for objcache_printstats. */
+static struct objcache *objcache_all = NULL;
+static struct spinlock objcache_all_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+objcache_register(struct objcache *oc)
+{
+	spinlock_acquire(&objcache_all_lock);
+	if (!oc->oc_listed) {
+		oc->oc_next = objcache_all;
+		objcache_all = oc;
+		oc->oc_listed = true;
+	}
+	spinlock_release(&objcache_all_lock);
+}
+
+void *
+objcache_get(struct objcache *oc)
+{
+	void *obj;
+
+	if (!oc->oc_listed) {
+		objcache_register(oc);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_gets++;
+	if (oc->oc_nfree > 0) {
+		obj = oc->oc_free[--oc->oc_nfree];
+		oc->oc_hits++;
+		oc->oc_inuse++;
+		spinlock_release(&oc->oc_lock);
+		return obj;
+	}
+	spinlock_release(&oc->oc_lock);
+
+	obj = kmalloc(oc->oc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (oc->oc_ctor != NULL && oc->oc_ctor(obj) != 0) {
+		kfree(obj);
+		return NULL;
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	oc->oc_ctors++;
+	oc->oc_inuse++;
+	spinlock_release(&oc->oc_lock);
+	return obj;
+}
+
+void
+objcache_put(struct objcache *oc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(oc->oc_inuse > 0);
+	oc->oc_inuse--;
+	if (oc->oc_nfree < OBJCACHE_DEPTH) {
+		oc->oc_free[oc->oc_nfree++] = obj;
+		spinlock_release(&oc->oc_lock);
+		return;
+	}
+	oc->oc_dtors++;
+	spinlock_release(&oc->oc_lock);
+
+	if (oc->oc_dtor != NULL) {
+		oc->oc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %6s %10s %10s %8s %8s %6s %6s\n", "name", "size",
+		"gets", "hits", "ctors", "dtors", "inuse", "free");
+
+	spinlock_acquire(&objcache_all_lock);
+	for (oc = objcache_all; oc != NULL; oc = oc->oc_next) {
+		kprintf("  %-12s %6u %10u %10u %8u %8u %6u %6u\n",
+			oc->oc_name, (unsigned)oc->oc_size, oc->oc_gets,
+			oc->oc_hits, oc->oc_ctors, oc->oc_dtors,
+			oc->oc_inuse, oc->oc_nfree);
+	}
+	spinlock_release(&objcache_all_lock);
+}
@@ -0,0 +1,688 @@
+/*
+ * Swap space management.
+ *
+ * Swap is a raw disk (SWAP_DEVICE) divided into page-sized slots.
+ * A bitmap records which slots are in use; it is protected by a
+ * spinlock so slots can be allocated and released by code that
+ * holds the page table lock. The I/O itself sleeps.
+ *
+ * In front of the disk is a pool of compressed pages in kernel heap.
+ * A page written to a slot is compressed into the pool if it shrinks
+ * enough and the pool has room, and only goes to the disk (spills)
+ * otherwise; reading the slot back then just decompresses it. Pages
+ * that are one word repeated, most often all zeros, take no space in
+ * the pool at all. If there is no swap disk, slots exist only in the
+ * pool, so eviction still works as long as pages compress.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <mainbus.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map = NULL;
+static unsigned swap_nslots = 0;
+static unsigned swap_nused = 0;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Where each slot's contents are, if not on the disk: zs_data holds
+ * zs_len bytes of compressed page, or if zs_fill is set the page is
+ * the word zs_word repeated. Protected by swap_lock.
+ */
+struct zslot {
+	void *zs_data;
+	uint16_t zs_len;
+	bool zs_fill;
+	uint32_t zs_word;
+};
+
+static struct zslot *zswap_slots = NULL;
+static size_t zswap_bytes = 0;		/* heap the pool is using... */
+static size_t zswap_maxbytes = 0;	/* ...and may use */
+static unsigned zswap_npages = 0;	/* slots held in the pool */
+static void *zswap_dead = NULL;		/* pool buffers waiting for kfree */
+
+/*
+ * Compressor state: match positions hashed by the next three bytes,
+ * and the output. One page is compressed at a time, under zswap_lock.
+ */
+#define ZSWAP_HASHBITS 12
+#define ZSWAP_NOPOS    0xffff
+#define ZSWAP_MINMATCH 3
+#define ZSWAP_MAXMATCH (ZSWAP_MINMATCH + 15)
+#define ZSWAP_GROUP    (1 + 8 * 2)	/* largest control byte + 8 items */
+
+static struct lock *zswap_lock = NULL;
+static uint16_t zswap_hash[1 << ZSWAP_HASHBITS];
+static uint8_t zswap_buf[ZSWAP_MAXLEN];
+
+/*
+ * Set up NSLOTS slots, and the compressed pool in front of them.
+ * With no disk they are all in the pool.
+ */
+static
+void
+zswap_bootstrap(unsigned nslots)
+{
+	unsigned i;
+
+	swap_nslots = nslots;
+	swap_map = bitmap_create(swap_nslots);
+	zswap_slots = kmalloc(swap_nslots * sizeof(struct zslot));
+	zswap_lock = lock_create("zswap");
+	if (swap_map == NULL || zswap_slots == NULL || zswap_lock == NULL) {
+		panic("swap: out of memory for slot tables\n");
+	}
+	for (i = 0; i < swap_nslots; i++) {
+		zswap_slots[i].zs_data = NULL;
+		zswap_slots[i].zs_len = 0;
+		zswap_slots[i].zs_fill = false;
+		zswap_slots[i].zs_word = 0;
+	}
+	zswap_maxbytes = mainbus_ramsize() / ZSWAP_POOLDIV;
+
+	kprintf("swap: compressed pool of up to %uK%s\n",
+		zswap_maxbytes / 1024,
+		swap_vnode == NULL ? ", no disk" : "");
+}
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_DEVICE)];
+	int result;
+
+	/* vfs_open may scribble on the path */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: cannot open %s: %s\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		zswap_bootstrap(mainbus_ramsize() / PAGE_SIZE);
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat of %s failed: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is empty\n", SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		zswap_bootstrap(mainbus_ramsize() / PAGE_SIZE);
+		return;
+	}
+
+	zswap_bootstrap(swap_nslots);
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_map != NULL;
+}
+
+/*
+ * Heap a pool buffer of LEN bytes really takes: kmalloc rounds small
+ * blocks up to a power of two.
+ */
+static
+size_t
+zswap_charge(size_t len)
+{
+	size_t sz;
+
+	for (sz = 16; sz < len; sz *= 2) {
+		/* nothing */
+	}
+	return sz;
+}
+
+/*
+ * Take SLOT's contents out of the pool, if they are in it. Called
+ * with swap_lock. swap_free runs with spinlocks held, including
+ * coremap_lock, so it can't call kfree; the buffer is chained on
+ * zswap_dead, through its first word, for swap_reap.
+ */
+static
+void
+zswap_drop(unsigned slot)
+{
+	struct zslot *zs;
+
+	KASSERT(spinlock_do_i_hold(&swap_lock));
+
+	zs = &zswap_slots[slot];
+	if (zs->zs_data != NULL) {
+		*(void **)zs->zs_data = zswap_dead;
+		zswap_dead = zs->zs_data;
+		zswap_bytes -= zswap_charge(zs->zs_len);
+		zswap_npages--;
+	}
+	else if (zs->zs_fill) {
+		zswap_npages--;
+	}
+	zs->zs_data = NULL;
+	zs->zs_len = 0;
+	zs->zs_fill = false;
+}
+
+/*
+ * Free the buffers zswap_drop left behind. Called where no spinlocks
+ * are held: from swap_read and swap_write, and from the VM system
+ * when pages are freed or memory runs short.
+ */
+void
+swap_reap(void)
+{
+	void *dead, *next;
+
+	spinlock_acquire(&swap_lock);
+	dead = zswap_dead;
+	zswap_dead = NULL;
+	spinlock_release(&swap_lock);
+
+	while (dead != NULL) {
+		next = *(void **)dead;
+		kfree(dead);
+		dead = next;
+	}
+}
+
+/*
+ * Compress the page at SRC into zswap_buf. This is LZRW1-style LZ77:
+ * a control byte says which of the next eight items are literal bytes
+ * and which are matches, and a match is two bytes, a 12-bit distance
+ * back into the page and a 4-bit length. Returns the compressed
+ * length, or 0 if it would be longer than ZSWAP_MAXLEN, which is as
+ * good as incompressible since anything longer costs kmalloc a page.
+ * Called with zswap_lock.
+ */
+static
+unsigned
+zswap_compress(const uint8_t *src)
+{
+	const uint8_t *ip, *end, *ref;
+	uint8_t *op, *ctrl;
+	unsigned bit, len, max, off, pos;
+	uint32_t h;
+
+	KASSERT(lock_do_i_hold(zswap_lock));
+
+	for (h = 0; h < (1 << ZSWAP_HASHBITS); h++) {
+		zswap_hash[h] = ZSWAP_NOPOS;
+	}
+
+	ip = src;
+	end = src + PAGE_SIZE;
+	op = zswap_buf;
+	ctrl = NULL;
+	bit = 8;
+	while (ip < end) {
+		if (bit == 8) {
+			if (op + ZSWAP_GROUP > zswap_buf + ZSWAP_MAXLEN) {
+				return 0;
+			}
+			ctrl = op++;
+			*ctrl = 0;
+			bit = 0;
+		}
+
+		len = 0;
+		off = 0;
+		if (end - ip >= ZSWAP_MINMATCH) {
+			h = ((uint32_t)ip[0] << 16 | (uint32_t)ip[1] << 8 |
+			     ip[2]) * 2654435761U;
+			h >>= 32 - ZSWAP_HASHBITS;
+			pos = zswap_hash[h];
+			zswap_hash[h] = ip - src;
+			if (pos != ZSWAP_NOPOS) {
+				ref = src + pos;
+				off = ip - ref;
+				max = end - ip;
+				if (max > ZSWAP_MAXMATCH) {
+					max = ZSWAP_MAXMATCH;
+				}
+				while (len < max && ref[len] == ip[len]) {
+					len++;
+				}
+				if (len < ZSWAP_MINMATCH) {
+					len = 0;
+				}
+			}
+		}
+
+		if (len > 0) {
+			*ctrl |= 1 << bit;
+			*op++ = off >> 4;
+			*op++ = (off & 0xf) << 4 | (len - ZSWAP_MINMATCH);
+			ip += len;
+		}
+		else {
+			*op++ = *ip++;
+		}
+		bit++;
+	}
+	return op - zswap_buf;
+}
+
+/*
+ * Undo zswap_compress: expand LEN bytes at SRC into the page at DST.
+ */
+static
+int
+zswap_decompress(const uint8_t *src, unsigned len, uint8_t *dst)
+{
+	const uint8_t *ip, *iend;
+	uint8_t *op, *oend;
+	unsigned ctrl, bit, mlen, off;
+
+	ip = src;
+	iend = src + len;
+	op = dst;
+	oend = dst + PAGE_SIZE;
+	ctrl = 0;
+	bit = 8;
+	while (op < oend) {
+		if (bit == 8) {
+			if (ip >= iend) {
+				return EIO;
+			}
+			ctrl = *ip++;
+			bit = 0;
+		}
+		if (ctrl & (1 << bit)) {
+			if (iend - ip < 2) {
+				return EIO;
+			}
+			off = (unsigned)ip[0] << 4 | ip[1] >> 4;
+			mlen = (ip[1] & 0xf) + ZSWAP_MINMATCH;
+			ip += 2;
+			if (off == 0 || off > (unsigned)(op - dst) ||
+			    mlen > (unsigned)(oend - op)) {
+				return EIO;
+			}
+			/* may overlap; copying forward repeats the pattern */
+			while (mlen-- > 0) {
+				*op = *(op - off);
+				op++;
+			}
+		}
+		else {
+			if (ip >= iend) {
+				return EIO;
+			}
+			*op++ = *ip++;
+		}
+		bit++;
+	}
+	return 0;
+}
+
+/*
+ * If the page at KBUF is one word repeated, return true and the word.
+ */
+static
+bool
+zswap_samefill(const void *kbuf, uint32_t *word)
+{
+	const uint32_t *p = kbuf;
+	unsigned i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p[i] != p[0]) {
+			return false;
+		}
+	}
+	*word = p[0];
+	return true;
+}
+
+/*
+ * Try to put the page at KBUF into the pool as SLOT's contents.
+ * Returns 0 if it went in, or ENOSPC if it doesn't compress well
+ * enough or there's no room for it.
+ *
+ * Only the evictor writes pages out, and it holds evict_lock, so the
+ * kmalloc here never tries to evict a page to make room; it just
+ * fails, and the page goes to disk.
+ */
+static
+int
+zswap_store(unsigned slot, const void *kbuf)
+{
+	struct zslot *zs;
+	uint32_t word;
+	unsigned len;
+	size_t charge;
+	void *data;
+
+	if (zswap_samefill(kbuf, &word)) {
+		spinlock_acquire(&swap_lock);
+		zs = &zswap_slots[slot];
+		zswap_drop(slot);
+		zs->zs_fill = true;
+		zs->zs_word = word;
+		zswap_npages++;
+		spinlock_release(&swap_lock);
+		vmstats_inc(VMSTAT_ZSWAP_STORE);
+		vmstats_inc(VMSTAT_ZSWAP_SAMEFILL);
+		return 0;
+	}
+
+	lock_acquire(zswap_lock);
+	len = zswap_compress(kbuf);
+	if (len == 0) {
+		lock_release(zswap_lock);
+		return ENOSPC;
+	}
+	charge = zswap_charge(len);
+
+	spinlock_acquire(&swap_lock);
+	if (zswap_bytes + charge > zswap_maxbytes) {
+		spinlock_release(&swap_lock);
+		lock_release(zswap_lock);
+		return ENOSPC;
+	}
+	/* hold our place while we allocate */
+	zswap_bytes += charge;
+	spinlock_release(&swap_lock);
+
+	data = kmalloc(len);
+	if (data != NULL) {
+		memcpy(data, zswap_buf, len);
+	}
+	lock_release(zswap_lock);
+
+	spinlock_acquire(&swap_lock);
+	zswap_bytes -= charge;
+	if (data == NULL) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	zs = &zswap_slots[slot];
+	zswap_drop(slot);
+	zs->zs_data = data;
+	zs->zs_len = len;
+	zswap_bytes += charge;
+	zswap_npages++;
+	spinlock_release(&swap_lock);
+
+	vmstats_inc(VMSTAT_ZSWAP_STORE);
+	vmstats_add(VMSTAT_ZSWAP_BYTES, len);
+	return 0;
+}
+
+/*
+ * If SLOT's contents are in the pool, expand them into the page at
+ * KBUF and return 0; return ENOENT if they're on the disk. Only the
+ * owner of a slot reads or frees it, so its buffer can't go away
+ * while we're using it.
+ */
+static
+int
+zswap_load(unsigned slot, void *kbuf)
+{
+	struct zslot zs;
+	uint32_t *p;
+	unsigned i;
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	zs = zswap_slots[slot];
+	spinlock_release(&swap_lock);
+
+	if (zs.zs_fill) {
+		p = kbuf;
+		for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+			p[i] = zs.zs_word;
+		}
+		result = 0;
+	}
+	else if (zs.zs_data != NULL) {
+		result = zswap_decompress(zs.zs_data, zs.zs_len, kbuf);
+	}
+	else {
+		return ENOENT;
+	}
+	if (result == 0) {
+		vmstats_inc(VMSTAT_ZSWAP_LOAD);
+	}
+	return result;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	KASSERT(swap_enabled());
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+
+	return result ? ENOSPC : 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+	zswap_drop(slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between a kernel buffer and a slot.
+ */
+static
+int
+swap_io(unsigned slot, void *kbuf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	if (swap_vnode == NULL) {
+		/* nowhere to spill to */
+		return ENOSPC;
+	}
+
+	uio_kinit(&iov, &ku, kbuf, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+/*
+ * Read SLOT into the page at PADDR, from the pool if it's there.
+ */
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	void *kbuf;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	swap_reap();
+	kbuf = (void *)PADDR_TO_KVADDR(paddr);
+	result = zswap_load(slot, kbuf);
+	if (result == ENOENT) {
+		result = swap_io(slot, kbuf, UIO_READ);
+	}
+	return result;
+}
+
+/*
+ * Write the page at PADDR into SLOT: into the pool if it fits,
+ * otherwise to disk.
+ */
+int
+swap_write(unsigned slot, paddr_t paddr)
+{
+	void *kbuf;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	swap_reap();
+	kbuf = (void *)PADDR_TO_KVADDR(paddr);
+	if (zswap_store(slot, kbuf) == 0) {
+		return 0;
+	}
+
+	/* spill: whatever the pool had for this slot is out of date */
+	spinlock_acquire(&swap_lock);
+	zswap_drop(slot);
+	spinlock_release(&swap_lock);
+	result = swap_io(slot, kbuf, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_ZSWAP_SPILL);
+	}
+	return result;
+}
+
+/*
+ * Make the pool's copy of slot FROM, if it has one, the contents of
+ * slot TO too. Returns ENOENT if FROM isn't in the pool.
+ */
+static
+int
+zswap_copy(unsigned from, unsigned to)
+{
+	struct zslot zs;
+	size_t charge;
+	void *data;
+
+	spinlock_acquire(&swap_lock);
+	zs = zswap_slots[from];
+	if (zs.zs_fill) {
+		zswap_slots[to] = zs;
+		zswap_npages++;
+		spinlock_release(&swap_lock);
+		return 0;
+	}
+	if (zs.zs_data == NULL) {
+		spinlock_release(&swap_lock);
+		return ENOENT;
+	}
+	charge = zswap_charge(zs.zs_len);
+	zswap_bytes += charge;
+	spinlock_release(&swap_lock);
+
+	/* this one may evict to make room, so no locks here */
+	data = kmalloc(zs.zs_len);
+	if (data != NULL) {
+		memcpy(data, zs.zs_data, zs.zs_len);
+	}
+
+	spinlock_acquire(&swap_lock);
+	if (data == NULL) {
+		zswap_bytes -= charge;
+		spinlock_release(&swap_lock);
+		return ENOMEM;
+	}
+	zswap_slots[to].zs_data = data;
+	zswap_slots[to].zs_len = zs.zs_len;
+	zswap_npages++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+int
+swap_dup(unsigned slot, unsigned *ret)
+{
+	void *buf;
+	unsigned newslot;
+	int result;
+
+	result = swap_alloc(&newslot);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * A page in the pool is copied within the pool, and one on disk
+	 * is copied on disk, so this never has to compress anything (see
+	 * zswap_store).
+	 */
+	result = zswap_copy(slot, newslot);
+	if (result == ENOENT) {
+		buf = kmalloc(PAGE_SIZE);
+		if (buf == NULL) {
+			result = ENOMEM;
+		}
+		else {
+			result = swap_io(slot, buf, UIO_READ);
+			if (result == 0) {
+				result = swap_io(newslot, buf, UIO_WRITE);
+			}
+			kfree(buf);
+		}
+	}
+	if (result) {
+		swap_free(newslot);
+		return result;
+	}
+
+	*ret = newslot;
+	return 0;
+}
+
+void
+swap_usage(unsigned *used, unsigned *total)
+{
+	spinlock_acquire(&swap_lock);
+	*used = swap_nused;
+	*total = swap_nslots;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_poolusage(unsigned *npages, size_t *bytes, size_t *maxbytes)
+{
+	spinlock_acquire(&swap_lock);
+	*npages = zswap_npages;
+	*bytes = zswap_bytes;
+	*maxbytes = zswap_maxbytes;
+	spinlock_release(&swap_lock);
+}
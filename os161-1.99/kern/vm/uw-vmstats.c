@@ -4,22 +4,42 @@
 
 /* NOTE !!!!!! WARNING !!!!!
  * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * assume that interrupts are already off
+ * (e.g., because the caller holds a spinlock).
  * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+ * with '_' turn interrupts off locally.
  */
 
 #include <types.h>
 #include <lib.h>
-#include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+/* Counters for tracking statistics.
+ * Faults, reloads and the rest are counted on the hottest paths in
+ * the VM system, so each cpu counts into slots of its own: counting
+ * is a plain increment with interrupts off, with no lock and no
+ * shared cache line. The slots are only added up when printed.
+ */
+struct vmstats_cpu {
+  unsigned int counts[VMSTAT_COUNT];
+  unsigned int hist[VMHIST_COUNT][VMHIST_BUCKETS];
+  unsigned int hist_usecs[VMHIST_COUNT];     /* total, for the mean */
+};
 
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+static struct vmstats_cpu stats_cpus[MAXCPUS];
+
+/* TLB misses served by the fast refill handler in exception-mips1.S,
+ * which bumps its cpu's slot itself, with no call and no trapframe.
+ * It writes a random TLB slot for a resident page, so when printed
+ * these count as TLB Faults, TLB Faults with Replace and TLB Reloads.
+ */
+unsigned int vmstats_fastrefills[MAXCPUS];
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -33,6 +53,32 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "ASID Rollovers",
+ /* 11 */ "TLB Flushes Avoided",
+ /* 12 */ "TLB Shootdowns",
+ /* 13 */ "TLB Shootdown Flushes",
+ /* 14 */ "TLB Shootdown Wait (usec)",
+ /* 15 */ "Page Faults from mmap",
+ /* 16 */ "mmap Writebacks",
+ /* 17 */ "Text Pages Shared",
+ /* 18 */ "Zero Pool Hits",
+ /* 19 */ "Zero Pool Misses",
+ /* 20 */ "Pages Zeroed when Idle",
+ /* 21 */ "Fault-around TLB Preloads",
+ /* 22 */ "Fault-around Pages Filled",
+ /* 23 */ "Pages Merged",
+ /* 24 */ "Pages Unmerged",
+ /* 25 */ "Swap Pages Compressed",
+ /* 26 */ "Swap Pages Same-filled",
+ /* 27 */ "Compressed Bytes",
+ /* 28 */ "Swap Reads from Pool",
+ /* 29 */ "Swap Pool Spills to Disk",
+};
+
+static const char *hist_names[] = {
+ /* 0 */ "Fault handling",
+ /* 1 */ "exec",
+ /* 2 */ "fork",
 };
 
 
@@ -41,23 +87,31 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
+    int spl = splhigh();
       _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+    splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int amount)
+{
+    int spl = splhigh();
+      _vmstats_add(index, amount);
+    splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
+  /* Other cpus may still be counting while the slots are cleared;
+   * the odd count that survives the reset doesn't matter.
    */
-  spinlock_init(&stats_lock);
-
-  spinlock_acquire(&stats_lock);
+  int spl = splhigh();
     _vmstats_init();
-  spinlock_release(&stats_lock);
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,32 +119,115 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  KASSERT(curthread->t_iplhigh_count > 0);
+  stats_cpus[curcpu->c_number].counts[index]++;
 }
 
 /* ---------------------------------------------------------------------- */
 void
-_vmstats_init(void)
+_vmstats_add(unsigned int index, unsigned int amount)
 {
-  int i = 0;
+  KASSERT(index < VMSTAT_COUNT);
+  KASSERT(curthread->t_iplhigh_count > 0);
+  stats_cpus[curcpu->c_number].counts[index] += amount;
+}
 
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_init(void)
+{
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
       (sizeof(stats_names) / sizeof(char *)), VMSTAT_COUNT);
     panic("Should really fix this before proceeding\n");
   }
+  if (sizeof(hist_names) / sizeof(char *) != VMHIST_COUNT) {
+    kprintf("vmstats_init: number of hist_names = %d != VMHIST_COUNT = %d\n",
+      (sizeof(hist_names) / sizeof(char *)), VMHIST_COUNT);
+    panic("Should really fix this before proceeding\n");
+  }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  bzero(stats_cpus, sizeof(stats_cpus));
+  bzero(vmstats_fastrefills, sizeof(vmstats_fastrefills));
+}
+
+/* ---------------------------------------------------------------------- */
+void
+vmstats_hist_add(unsigned int hist, uint32_t usecs)
+{
+  unsigned int bucket = 0;
+  struct vmstats_cpu *sc;
+  int spl;
+
+  KASSERT(hist < VMHIST_COUNT);
+
+  /* bucket i holds times from 2^(i-1) up to 2^i usec */
+  while (usecs >> bucket != 0 && bucket < VMHIST_BUCKETS - 1) {
+    bucket++;
   }
 
+  spl = splhigh();
+    sc = &stats_cpus[curcpu->c_number];
+    sc->hist[hist][bucket]++;
+    sc->hist_usecs[hist] += usecs;
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+void
+vmstats_hist_since(unsigned int hist, time_t secs, uint32_t nsecs)
+{
+  time_t now_secs;
+  uint32_t now_nsecs;
+
+  gettime(&now_secs, &now_nsecs);
+  getinterval(secs, nsecs, now_secs, now_nsecs, &secs, &nsecs);
+  vmstats_hist_add(hist, secs * 1000000 + nsecs / 1000);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Add up and print one histogram, skipping it if it is empty */
+static
+void
+vmstats_hist_print(unsigned int hist)
+{
+  unsigned int buckets[VMHIST_BUCKETS];
+  unsigned int total = 0, usecs = 0;
+  unsigned int b, c;
+
+  for (b=0; b<VMHIST_BUCKETS; b++) {
+    buckets[b] = 0;
+    for (c=0; c<MAXCPUS; c++) {
+      buckets[b] += stats_cpus[c].hist[hist][b];
+    }
+    total += buckets[b];
+  }
+  for (c=0; c<MAXCPUS; c++) {
+    usecs += stats_cpus[c].hist_usecs[hist];
+  }
+  if (total == 0) {
+    return;
+  }
+
+  kprintf("VMHIST %s: %u, mean %u usec\n", hist_names[hist], total, usecs / total);
+  for (b=0; b<VMHIST_BUCKETS; b++) {
+    if (buckets[b] == 0) {
+      continue;
+    }
+    if (b == VMHIST_BUCKETS - 1) {
+      kprintf("VMHIST   %8u usec and up = %10u\n", 1U << (b - 1), buckets[b]);
+    }
+    else {
+      kprintf("VMHIST   %8u - %8u usec = %10u\n", b == 0 ? 0 : 1U << (b - 1), 1U << b, buckets[b]);
+    }
+  }
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* NOTE: Other cpus may still be counting while the slots are added up,
+ * so the totals need not agree exactly unless this is used
+ * when there is only one thread remaining.
  */
 
 void
@@ -102,18 +239,42 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int shootdowns = 0;
+  int zeropool_takes = 0;
+  unsigned int compressed = 0;
+  unsigned int fastrefills = 0;
+  unsigned int c;
+  unsigned int stats_counts[VMSTAT_COUNT];
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_counts[i] = 0;
+    for (c=0; c<MAXCPUS; c++) {
+      stats_counts[i] += stats_cpus[c].counts[i];
+    }
+  }
+  for (c=0; c<MAXCPUS; c++) {
+    fastrefills += vmstats_fastrefills[c];
+  }
+  stats_counts[VMSTAT_TLB_FAULT] += fastrefills;
+  stats_counts[VMSTAT_TLB_FAULT_REPLACE] += fastrefills;
+  stats_counts[VMSTAT_TLB_RELOAD] += fastrefills;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
     kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
   }
+  kprintf("VMSTAT %25s = %10d (included above)\n", "TLB Fast-path Refills",
+    fastrefills);
 
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ] +
+    stats_counts[VMSTAT_MMAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  shootdowns = stats_counts[VMSTAT_TLB_SHOOTDOWN];
+  zeropool_takes = stats_counts[VMSTAT_ZEROPOOL_HIT] + stats_counts[VMSTAT_ZEROPOOL_MISS];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -128,10 +289,36 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Swapfile reads + mmap reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Swapfile reads + mmap reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  if (shootdowns > 0) {
+    kprintf("VMSTAT TLB Shootdown average wait = %d usec\n",
+      stats_counts[VMSTAT_TLB_SHOOTDOWN_USEC] / shootdowns);
+  }
+
+  if (zeropool_takes > 0) {
+    kprintf("VMSTAT Zero Pool hit rate = %d%%\n",
+      stats_counts[VMSTAT_ZEROPOOL_HIT] * 100 / zeropool_takes);
+  }
+
+  if (stats_counts[VMSTAT_MERGE] > 0) {
+    kprintf("VMSTAT Bytes saved by merging (net of unmerges) = %d\n",
+      (int)(stats_counts[VMSTAT_MERGE] - stats_counts[VMSTAT_UNMERGE]) * PAGE_SIZE);
+  }
+
+  /* Same-filled pages take no space, so leave them out of the ratio */
+  compressed = stats_counts[VMSTAT_ZSWAP_STORE] - stats_counts[VMSTAT_ZSWAP_SAMEFILL];
+  if (compressed > 0 && stats_counts[VMSTAT_ZSWAP_BYTES] > 0) {
+    kprintf("VMSTAT Swap compression ratio = %d%%\n",
+      (int)((uint64_t)compressed * PAGE_SIZE * 100 / stats_counts[VMSTAT_ZSWAP_BYTES]));
+  }
+
+  for (i=0; i<VMHIST_COUNT; i++) {
+    vmstats_hist_print(i);
+  }
 }
 /* ---------------------------------------------------------------------- */
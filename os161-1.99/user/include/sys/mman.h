@@ -0,0 +1,7 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/* This file is for UNIX compat. In OS/161, everything's in <unistd.h> */
+#include <unistd.h>
+
+#endif /* _SYS_MMAN_H_ */
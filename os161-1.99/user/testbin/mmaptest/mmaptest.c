@@ -0,0 +1,234 @@
+/*
+ * mmaptest.c
+ *
+ *    Tests mmap and munmap.
+ *
+ *    First maps some anonymous MAP_SHARED memory, forks, and checks
+ *    that what the child writes there is seen by the parent, both in
+ *    pages the parent touched before the fork and in pages it didn't.
+ *
+ *    Then maps a file (by default this program's own executable)
+ *    privately and read-only, checks that it starts with an ELF
+ *    header, unmaps it, and checks that a second mapping reads the
+ *    same thing, and that writing to a private mapping doesn't change
+ *    the file.
+ *
+ *    Last, maps the same file MAP_SHARED twice and checks that writes
+ *    through one mapping show up in the other at once, and reach the
+ *    file on fsync and on munmap. It writes to the padding bytes of
+ *    the ELF identification, which nothing reads, and puts back what
+ *    was there before it is done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PageSize	4096
+#define SharedPages	8
+#define DefaultFile	"/testbin/mmaptest"
+#define PadOffset	9	/* EI_PAD: e_ident bytes nobody reads */
+#define PadSize		7
+
+static
+void
+test_shared_anon(void)
+{
+	volatile int *mem;
+	pid_t pid;
+	int status, i, bad;
+
+	mem = mmap(NULL, SharedPages * PageSize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANON, -1, 0);
+	if (mem == MAP_FAILED) {
+		err(1, "mmap anonymous");
+	}
+	/*
+	 * Touch half of it before the fork; fresh pages read as zero.
+	 * Leave the other half alone, so the child touches it first.
+	 */
+	for (i=0; i<SharedPages/2; i++) {
+		if (mem[i * PageSize / sizeof(int)] != 0) {
+			errx(1, "anonymous page %d not zeroed", i);
+		}
+		mem[i * PageSize / sizeof(int)] = -1;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<SharedPages; i++) {
+			mem[i * PageSize / sizeof(int)] = i + 1;
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+
+	bad = 0;
+	for (i=0; i<SharedPages; i++) {
+		if (mem[i * PageSize / sizeof(int)] != i + 1) {
+			warnx("shared page %d: child's write not seen%s", i,
+			      i < SharedPages/2 ? "" : " (untouched at fork)");
+			bad++;
+		}
+	}
+	if (bad) {
+		errx(1, "%d shared pages did not see the child's writes", bad);
+	}
+	if (munmap((void *)mem, SharedPages * PageSize) < 0) {
+		err(1, "munmap anonymous");
+	}
+	printf("mmaptest: shared anonymous memory: passed\n");
+}
+
+/*
+ * Check that the file open on FD has EXPECT at PadOffset, as read
+ * through a new mapping. The last shared mapping to write there has
+ * been synced or unmapped, so this reads what is in the file.
+ */
+static
+void
+check_file(int fd, const char *path, const char *expect, const char *what)
+{
+	char *map;
+
+	map = mmap(NULL, PageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err(1, "mmap %s to check it", path);
+	}
+	if (memcmp(map + PadOffset, expect, PadSize) != 0) {
+		errx(1, "%s: %s", path, what);
+	}
+	if (munmap(map, PageSize) < 0) {
+		err(1, "munmap %s", path);
+	}
+}
+
+static
+void
+test_private_file(const char *path)
+{
+	char *map1, *map2;
+	char first[PageSize];
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+
+	map1 = mmap(NULL, PageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map1 == MAP_FAILED) {
+		err(1, "mmap %s", path);
+	}
+	if (memcmp(map1, "\177ELF", 4) != 0) {
+		errx(1, "%s: mapping does not start with an ELF header", path);
+	}
+	memcpy(first, map1, PageSize);
+	if (munmap(map1, PageSize) < 0) {
+		err(1, "munmap %s", path);
+	}
+
+	/* mapping a writable region over the file doesn't need O_RDWR */
+	map2 = mmap(NULL, PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		    fd, 0);
+	if (map2 == MAP_FAILED) {
+		err(1, "mmap %s again", path);
+	}
+	if (memcmp(map2, first, PageSize) != 0) {
+		errx(1, "%s: second mapping differs from the first", path);
+	}
+	/* private: this must not reach the file */
+	memset(map2, 0, PageSize);
+
+	if (munmap(map2, PageSize) < 0) {
+		err(1, "munmap %s again", path);
+	}
+	check_file(fd, path, first + PadOffset,
+		   "write to a private mapping reached the file");
+	close(fd);
+	printf("mmaptest: private file mapping: passed\n");
+}
+
+static
+void
+test_shared_file(const char *path)
+{
+	char *map1, *map2;
+	char saved[PadSize];
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", path);
+	}
+
+	/* two separate mappings; nothing touches the second one yet */
+	map1 = mmap(NULL, PageSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (map1 == MAP_FAILED) {
+		err(1, "mmap %s shared", path);
+	}
+	map2 = mmap(NULL, PageSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (map2 == MAP_FAILED) {
+		err(1, "mmap %s shared again", path);
+	}
+
+	memcpy(saved, map1 + PadOffset, PadSize);
+	memcpy(map1 + PadOffset, "shared1", PadSize);
+	if (memcmp(map2 + PadOffset, "shared1", PadSize) != 0) {
+		errx(1, "%s: write through one shared mapping not seen "
+		     "through the other", path);
+	}
+
+	if (fsync(fd) < 0) {
+		err(1, "fsync %s", path);
+	}
+	check_file(fd, path, "shared1", "fsync did not write back");
+
+	memcpy(map2 + PadOffset, "shared2", PadSize);
+	if (memcmp(map1 + PadOffset, "shared2", PadSize) != 0) {
+		errx(1, "%s: second write not seen through the first "
+		     "mapping", path);
+	}
+	if (munmap(map2, PageSize) < 0) {
+		err(1, "munmap %s shared", path);
+	}
+	check_file(fd, path, "shared2", "munmap did not write back");
+
+	/* put it back */
+	memcpy(map1 + PadOffset, saved, PadSize);
+	if (munmap(map1, PageSize) < 0) {
+		err(1, "munmap %s shared again", path);
+	}
+	check_file(fd, path, saved, "could not restore the file");
+
+	close(fd);
+	printf("mmaptest: shared file mapping: passed\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path;
+
+	path = argc > 1 ? argv[1] : DefaultFile;
+	test_shared_anon();
+	test_private_file(path);
+	test_shared_file(path);
+	printf("mmaptest: %d: passed\n", getpid());
+	return 0;
+}
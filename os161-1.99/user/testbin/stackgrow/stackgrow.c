@@ -0,0 +1,88 @@
+/*
+ * stackgrow.c
+ *
+ *    Tests that the user stack grows on demand. Recurses with a
+ *    1K frame per call to a depth (default 2048, so about 2M of
+ *    stack) far beyond the 48K stack dumbvm used to give every
+ *    process, then checks that each frame still holds what was
+ *    written into it on the way down.
+ *
+ *    Also forks once at the deepest point, so the grown stack has
+ *    to be copied correctly too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define FrameWords	256
+#define DefaultDepth	2048
+
+static
+int
+check_fork(void)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		/* the child unwinds its copy of the stack */
+		return 0;
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	/* and the parent unwinds its own */
+	return 0;
+}
+
+static
+int
+recurse(int depth)
+{
+	volatile int frame[FrameWords];
+	int i, bad;
+
+	for (i=0; i<FrameWords; i++) {
+		frame[i] = depth * FrameWords + i;
+	}
+
+	bad = (depth == 0) ? check_fork() : recurse(depth - 1);
+
+	for (i=0; i<FrameWords; i++) {
+		if (frame[i] != depth * FrameWords + i) {
+			bad++;
+		}
+	}
+	return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+	int depth = DefaultDepth;
+	int bad;
+
+	if (argc > 1) {
+		depth = atoi(argv[1]);
+	}
+
+	printf("stackgrow: recursing %d frames (%d KB)\n",
+	       depth, depth * FrameWords * (int)sizeof(int) / 1024);
+	bad = recurse(depth);
+	if (bad) {
+		printf("stackgrow: %d corrupt words on the stack\n", bad);
+		return 1;
+	}
+	printf("stackgrow: %d: passed\n", getpid());
+	return 0;
+}
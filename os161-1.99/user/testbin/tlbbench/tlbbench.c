@@ -0,0 +1,100 @@
+/*
+ * tlbbench.c
+ *
+ *    Measure the cost of a TLB refill.
+ *
+ *    Touches every page of a large array once so that all of it is
+ *    resident, then times the same number of loads over two access
+ *    patterns: one that fits in the 64-entry TLB and one that cycles
+ *    through far more pages than the TLB holds, so nearly every load
+ *    is a refill. The difference divided by the number of refills is
+ *    the refill latency.
+ *
+ *    There is no user-visible cycle counter, so cycles are estimated
+ *    from wall-clock time and the processor clock rate, which may be
+ *    given in MHz as the first argument (sys161 defaults to 25).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PageSize	4096
+#define NumPages	256	/* well beyond the 64 TLB entries */
+#define HotPages	32	/* comfortably within them */
+#define NumLoads	(NumPages * 400)
+
+#define DefaultMHz	25
+
+static char pages[NumPages][PageSize];
+
+/*
+ * Load one byte from each of NPAGES pages in turn until NumLoads loads
+ * have been done; return the elapsed time in nanoseconds.
+ */
+static
+unsigned long long
+sweep(int npages)
+{
+	time_t s1, s2;
+	unsigned long ns1, ns2;
+	volatile char sink;
+	int i, p;
+
+	__time(&s1, &ns1);
+	p = 0;
+	for (i=0; i<NumLoads; i++) {
+		sink = pages[p][0];
+		if (++p == npages) {
+			p = 0;
+		}
+	}
+	__time(&s2, &ns2);
+	(void)sink;
+
+	return (unsigned long long)(s2 - s1) * 1000000000ULL + ns2 - ns1;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long long hot, cold, perrefill;
+	unsigned long mhz = DefaultMHz;
+	int i;
+
+	if (argc > 1) {
+		mhz = atoi(argv[1]);
+		if (mhz == 0) {
+			printf("Usage: tlbbench [MHz]\n");
+			return 1;
+		}
+	}
+
+	/* fault everything in so only TLB refills are measured below */
+	for (i=0; i<NumPages; i++) {
+		pages[i][0] = i;
+	}
+	/* warm up both patterns once */
+	sweep(HotPages);
+	sweep(NumPages);
+
+	hot = sweep(HotPages);
+	cold = sweep(NumPages);
+
+	printf("tlbbench: %d loads over %d pages: %llu ns\n",
+	       NumLoads, HotPages, hot);
+	printf("tlbbench: %d loads over %d pages: %llu ns\n",
+	       NumLoads, NumPages, cold);
+
+	if (cold <= hot) {
+		printf("tlbbench: no measurable refill cost\n");
+		return 0;
+	}
+
+	/* every load in the cold sweep misses; none in the hot one */
+	perrefill = (cold - hot) / NumLoads;
+	printf("tlbbench: %llu ns per refill, about %llu cycles at %lu MHz\n",
+	       perrefill, perrefill * mhz / 1000, mhz);
+
+	return 0;
+}